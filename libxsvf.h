@@ -27,6 +27,29 @@ enum libxsvf_mode {
 	LIBXSVF_MODE_SCAN = 3
 };
 
+enum libxsvf_step {
+	LIBXSVF_STEP_ERROR = -1,
+	LIBXSVF_STEP_DONE = 0,
+	LIBXSVF_STEP_CONTINUE = 1,
+	LIBXSVF_STEP_NEED_INPUT = 2,
+	LIBXSVF_STEP_NEED_SYNC = 3
+};
+
+enum libxsvf_flags {
+	LIBXSVF_FLAG_KEEP_TAPSTATE = 1,
+	LIBXSVF_FLAG_WAIT_TCK = 2,
+	LIBXSVF_FLAG_SKIP_SAME_IR = 4,
+	LIBXSVF_FLAG_COMPRESS_XSVF = 8
+};
+
+enum libxsvf_shift_same {
+	LIBXSVF_SHIFT_SAME_TDI_DATA = 1,
+	LIBXSVF_SHIFT_SAME_TDI_MASK = 2,
+	LIBXSVF_SHIFT_SAME_TDO_DATA = 4,
+	LIBXSVF_SHIFT_SAME_TDO_MASK = 8,
+	LIBXSVF_SHIFT_SAME_RET_MASK = 16
+};
+
 enum libxsvf_tap_state {
 	/* Special States */
 	LIBXSVF_TAP_INIT = 0,
@@ -87,7 +110,97 @@ enum libxsvf_mem {
 	LIBXSVF_MEM_SVF_TIR_TDO_DATA = 33,
 	LIBXSVF_MEM_SVF_TIR_TDO_MASK = 34,
 	LIBXSVF_MEM_SVF_TIR_RET_MASK = 35,
-	LIBXSVF_MEM_NUM = 36
+	LIBXSVF_MEM_SVF_STATE = 36,
+	LIBXSVF_MEM_XSVF_STATE = 37,
+	LIBXSVF_MEM_XSVF_COMMANDBUF = 38,
+	LIBXSVF_MEM_PROGRAM_OPS = 39,
+	LIBXSVF_MEM_PROGRAM_DATA = 40,
+	LIBXSVF_MEM_SVF2XSVF_DATA = 41,
+	LIBXSVF_MEM_SVF2XSVF_BUFFER = 42,
+	LIBXSVF_MEM_SVF_DRSCAN_TDI_DATA = 43,
+	LIBXSVF_MEM_SVF_DRSCAN_TDI_MASK = 44,
+	LIBXSVF_MEM_SVF_DRSCAN_TDO_DATA = 45,
+	LIBXSVF_MEM_SVF_DRSCAN_TDO_MASK = 46,
+	LIBXSVF_MEM_SVF_DRSCAN_RET_MASK = 47,
+	LIBXSVF_MEM_SVF_IRSCAN_TDI_DATA = 48,
+	LIBXSVF_MEM_SVF_IRSCAN_TDI_MASK = 49,
+	LIBXSVF_MEM_SVF_IRSCAN_TDO_DATA = 50,
+	LIBXSVF_MEM_SVF_IRSCAN_TDO_MASK = 51,
+	LIBXSVF_MEM_SVF_IRSCAN_RET_MASK = 52,
+	LIBXSVF_MEM_XSVF_SDRINC_RUNS = 53,
+	LIBXSVF_MEM_SVF2XSVF_PREVIOUS = 54,
+	LIBXSVF_MEM_RETRY_BATCH = 55,
+	LIBXSVF_MEM_RETRY_OPS = 56,
+	LIBXSVF_MEM_RETRY_DATA = 57,
+	LIBXSVF_MEM_NUM = 58
+};
+
+enum libxsvf_op_type {
+	LIBXSVF_OP_TAP = 1,
+	LIBXSVF_OP_SHIFT = 2,
+	LIBXSVF_OP_XSHIFT = 3,
+	LIBXSVF_OP_UDELAY = 4,
+	LIBXSVF_OP_SCK = 5,
+	LIBXSVF_OP_TRST = 6,
+	LIBXSVF_OP_FREQUENCY = 7,
+	LIBXSVF_OP_SYNC = 8
+};
+
+struct libxsvf_location {
+	long command;
+	long line;
+	long offset;
+};
+
+struct libxsvf_op {
+	enum libxsvf_op_type type;
+	enum libxsvf_tap_state state, estate;
+	int len, tms, retries;
+	long value, num_tck;
+	const unsigned char *tdi_data;
+	const unsigned char *tdi_mask;
+	const unsigned char *tdo_data;
+	const unsigned char *tdo_mask;
+	const unsigned char *ret_mask;
+};
+
+struct libxsvf_program_op {
+	struct libxsvf_op op;
+	struct libxsvf_location location;
+	int data[5];
+};
+
+struct libxsvf_program {
+	struct libxsvf_program_op *ops;
+	int ops_num, ops_len;
+	unsigned char *data;
+	int data_num, data_len;
+	int last_data[5], last_bytes[5];
+	enum libxsvf_mem mem_ops, mem_data;
+};
+
+struct libxsvf_poll {
+	long min_usecs, interval_usecs;
+	int ir_len, dr_len;
+	const unsigned char *ir_tdi;
+	const unsigned char *dr_tdo;
+	const unsigned char *dr_mask;
+};
+
+/* no TAP state: libxsvf_resume() starts in the TAP state left by the last run (see README) */
+struct libxsvf_checkpoint {
+	struct libxsvf_location location;
+};
+
+struct libxsvf_host;
+
+struct libxsvf_stats {
+	long frequency;
+	long long tck, sck, tdo_bits;
+	long long wait_usecs, usecs;
+	int mem_max[LIBXSVF_MEM_NUM];
+	long long frequency_tck;
+	void *(*host_realloc)(struct libxsvf_host *h, void *ptr, int size, enum libxsvf_mem which);
 };
 
 struct libxsvf_host {
@@ -95,8 +208,12 @@ struct libxsvf_host {
 	int (*shutdown)(struct libxsvf_host *h);
 	void (*udelay)(struct libxsvf_host *h, long usecs, int tms, long num_tck);
 	int (*getbyte)(struct libxsvf_host *h);
+	int (*getblock)(struct libxsvf_host *h, const unsigned char **block);
 	int (*sync)(struct libxsvf_host *h);
 	int (*pulse_tck)(struct libxsvf_host *h, int tms, int tdi, int tdo, int rmask, int sync);
+	int (*shift)(struct libxsvf_host *h, int len, const unsigned char *tdi_data, const unsigned char *tdi_mask,
+			const unsigned char *tdo_data, const unsigned char *tdo_mask, const unsigned char *ret_mask, int tms_last, int sync);
+	void (*tms_sequence)(struct libxsvf_host *h, int tms, int count);
 	void (*pulse_sck)(struct libxsvf_host *h);
 	void (*set_trst)(struct libxsvf_host *h, int v);
 	int (*set_frequency)(struct libxsvf_host *h, int v);
@@ -105,27 +222,102 @@ struct libxsvf_host {
 	void (*report_status)(struct libxsvf_host *h, const char *message);
 	void (*report_error)(struct libxsvf_host *h, const char *file, int line, const char *message);
 	void *(*realloc)(struct libxsvf_host *h, void *ptr, int size, enum libxsvf_mem which);
+	int (*put_op)(struct libxsvf_host *h, const struct libxsvf_op *op);
+	int (*checkpoint)(struct libxsvf_host *h, const struct libxsvf_checkpoint *cp);
+	int flags;
+	long frequency;
+	int wait_margin;
+	int shift_same;
+	long skipped_ir_bits;
+	int retry_batch;
+	long retry_replays;
 	enum libxsvf_tap_state tap_state;
+	const unsigned char *block;
+	int block_len, block_pos;
+	long block_offset;
+	int push_mode, push_eof;
+	enum libxsvf_mode run_mode;
+	int run_state, run_rc;
+	void *run_data;
+	struct libxsvf_program *program;
+	struct libxsvf_stats *stats;
+	const struct libxsvf_poll *poll;
+	const struct libxsvf_checkpoint *resume;
+	struct libxsvf_op resume_frequency, resume_trst;
+	void *retry_data;
+	struct libxsvf_location location, error_location;
 	void *user_data;
 };
 
 int libxsvf_play(struct libxsvf_host *, enum libxsvf_mode mode);
+int libxsvf_open(struct libxsvf_host *);
+int libxsvf_run(struct libxsvf_host *, enum libxsvf_mode mode);
+int libxsvf_close(struct libxsvf_host *);
+int libxsvf_start(struct libxsvf_host *, enum libxsvf_mode mode);
+void libxsvf_feed(struct libxsvf_host *, const unsigned char *buf, int len);
+int libxsvf_step(struct libxsvf_host *);
+int libxsvf_compile(struct libxsvf_host *, struct libxsvf_program *prog, enum libxsvf_mode mode);
+int libxsvf_execute(struct libxsvf_host *, const struct libxsvf_program *prog);
+void libxsvf_program_free(struct libxsvf_host *, struct libxsvf_program *prog);
+int libxsvf_analyze(struct libxsvf_host *, struct libxsvf_stats *stats, enum libxsvf_mode mode);
+int libxsvf_parse(struct libxsvf_host *, enum libxsvf_mode mode);
+int libxsvf_execute_op(struct libxsvf_host *, const struct libxsvf_op *op);
+int libxsvf_resume(struct libxsvf_host *, enum libxsvf_mode mode, const struct libxsvf_checkpoint *cp);
+int libxsvf_svf2xsvf(struct libxsvf_host *, int max_chunk, unsigned char **xsvf, int *xsvf_len);
 const char *libxsvf_state2str(enum libxsvf_tap_state tap_state);
 const char *libxsvf_mem2str(enum libxsvf_mem which);
 
 /* Internal API */ 
 int libxsvf_svf(struct libxsvf_host *h);
+int libxsvf_svf_start(struct libxsvf_host *h);
+int libxsvf_svf_step(struct libxsvf_host *h);
+int libxsvf_svf_finish(struct libxsvf_host *h, int rc);
 int libxsvf_xsvf(struct libxsvf_host *h);
+int libxsvf_xsvf_start(struct libxsvf_host *h);
+int libxsvf_xsvf_step(struct libxsvf_host *h);
+int libxsvf_xsvf_finish(struct libxsvf_host *h, int rc);
 int libxsvf_scan(struct libxsvf_host *h);
 int libxsvf_tap_walk(struct libxsvf_host *, enum libxsvf_tap_state);
+int libxsvf_tap_walk_len(enum libxsvf_tap_state from, enum libxsvf_tap_state to);
+int libxsvf_tap_keeps_ir(enum libxsvf_tap_state s);
+int libxsvf_getbyte(struct libxsvf_host *h);
+int libxsvf_read(struct libxsvf_host *h, unsigned char *buf, int len);
+int libxsvf_tap_shift(struct libxsvf_host *h, int len, const unsigned char *tdi_data, const unsigned char *tdi_mask,
+		const unsigned char *tdo_data, const unsigned char *tdo_mask, const unsigned char *ret_mask,
+		enum libxsvf_tap_state estate, int sync);
+int libxsvf_op(struct libxsvf_host *h, const struct libxsvf_op *op);
+int libxsvf_op_tap(struct libxsvf_host *h, enum libxsvf_tap_state state);
+int libxsvf_op_shift(struct libxsvf_host *h, int len, const unsigned char *tdi_data, const unsigned char *tdi_mask,
+		const unsigned char *tdo_data, const unsigned char *tdo_mask, const unsigned char *ret_mask,
+		enum libxsvf_tap_state estate);
+int libxsvf_op_xshift(struct libxsvf_host *h, int len, const unsigned char *tdi_data,
+		const unsigned char *tdo_data, const unsigned char *tdo_mask,
+		enum libxsvf_tap_state state, enum libxsvf_tap_state estate, long edelay, int retries);
+int libxsvf_op_udelay(struct libxsvf_host *h, long usecs, int tms, long num_tck);
+int libxsvf_op_sck(struct libxsvf_host *h, long count);
+int libxsvf_op_trst(struct libxsvf_host *h, int v);
+int libxsvf_op_frequency(struct libxsvf_host *h, long v);
+int libxsvf_op_sync(struct libxsvf_host *h);
+int libxsvf_program_play(struct libxsvf_host *h, const struct libxsvf_program *prog);
+int libxsvf_program_loop(struct libxsvf_host *h, const struct libxsvf_program *prog, long count);
+void libxsvf_program_init(struct libxsvf_program *prog);
+int libxsvf_op_poll(struct libxsvf_host *h, const struct libxsvf_poll *poll, enum libxsvf_tap_state state);
+int libxsvf_checkpoint(struct libxsvf_host *h);
+int libxsvf_op_resume(struct libxsvf_host *h);
+int libxsvf_op_flush(struct libxsvf_host *h);
+void libxsvf_op_free(struct libxsvf_host *h);
 
 /* Host accessor macros (see README) */
 #define LIBXSVF_HOST_SETUP() h->setup(h)
 #define LIBXSVF_HOST_SHUTDOWN() h->shutdown(h)
 #define LIBXSVF_HOST_UDELAY(_usecs, _tms, _num_tck) h->udelay(h, _usecs, _tms, _num_tck)
 #define LIBXSVF_HOST_GETBYTE() h->getbyte(h)
+#define LIBXSVF_HOST_GETBLOCK(_block) h->getblock(h, _block)
 #define LIBXSVF_HOST_SYNC() (h->sync ? h->sync(h) : 0)
 #define LIBXSVF_HOST_PULSE_TCK(_tms, _tdi, _tdo, _rmask, _sync) h->pulse_tck(h, _tms, _tdi, _tdo, _rmask, _sync)
+#define LIBXSVF_HOST_SHIFT(_len, _tdi, _tdi_mask, _tdo, _tdo_mask, _ret_mask, _tms_last, _sync) \
+		h->shift(h, _len, _tdi, _tdi_mask, _tdo, _tdo_mask, _ret_mask, _tms_last, _sync)
+#define LIBXSVF_HOST_TMS_SEQUENCE(_tms, _count) h->tms_sequence(h, _tms, _count)
 #define LIBXSVF_HOST_PULSE_SCK() do { if (h->pulse_sck) h->pulse_sck(h); } while (0)
 #define LIBXSVF_HOST_SET_TRST(_v) do { if (h->set_trst) h->set_trst(h, _v); } while (0)
 #define LIBXSVF_HOST_SET_FREQUENCY(_v) (h->set_frequency ? h->set_frequency(h, _v) : -1)
@@ -134,6 +326,11 @@ int libxsvf_tap_walk(struct libxsvf_host *, enum libxsvf_tap_state);
 #define LIBXSVF_HOST_REPORT_STATUS(_msg) do { if (h->report_status) h->report_status(h, _msg); } while (0)
 #define LIBXSVF_HOST_REPORT_ERROR(_msg) h->report_error(h, __FILE__, __LINE__, _msg)
 #define LIBXSVF_HOST_REALLOC(_ptr, _size, _which) h->realloc(h, _ptr, _size, _which)
+#define LIBXSVF_HOST_PUT_OP(_op) h->put_op(h, _op)
+#define LIBXSVF_HOST_CHECKPOINT(_cp) (h->checkpoint ? h->checkpoint(h, _cp) : 0)
+
+/* Read the next input byte, without a function call while the current getblock() buffer lasts */
+#define LIBXSVF_GETBYTE() (h->block_pos < h->block_len ? h->block[h->block_pos++] : libxsvf_getbyte(h))
 
 #endif
 
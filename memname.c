@@ -59,6 +59,28 @@ const char *libxsvf_mem2str(enum libxsvf_mem which)
 	X(SVF_SIR_TDO_DATA, svf_sir_tdo_data)
 	X(SVF_SIR_TDO_MASK, svf_sir_tdo_mask)
 	X(SVF_SIR_RET_MASK, svf_sir_ret_mask)
+	X(SVF_STATE, svf_state)
+	X(XSVF_STATE, xsvf_state)
+	X(XSVF_COMMANDBUF, xsvf_commandbuf)
+	X(PROGRAM_OPS, program_ops)
+	X(PROGRAM_DATA, program_data)
+	X(SVF2XSVF_DATA, svf2xsvf_data)
+	X(SVF2XSVF_BUFFER, svf2xsvf_buffer)
+	X(SVF_DRSCAN_TDI_DATA, svf_drscan_tdi_data)
+	X(SVF_DRSCAN_TDI_MASK, svf_drscan_tdi_mask)
+	X(SVF_DRSCAN_TDO_DATA, svf_drscan_tdo_data)
+	X(SVF_DRSCAN_TDO_MASK, svf_drscan_tdo_mask)
+	X(SVF_DRSCAN_RET_MASK, svf_drscan_ret_mask)
+	X(SVF_IRSCAN_TDI_DATA, svf_irscan_tdi_data)
+	X(SVF_IRSCAN_TDI_MASK, svf_irscan_tdi_mask)
+	X(SVF_IRSCAN_TDO_DATA, svf_irscan_tdo_data)
+	X(SVF_IRSCAN_TDO_MASK, svf_irscan_tdo_mask)
+	X(SVF_IRSCAN_RET_MASK, svf_irscan_ret_mask)
+	X(XSVF_SDRINC_RUNS, xsvf_sdrinc_runs)
+	X(SVF2XSVF_PREVIOUS, svf2xsvf_previous)
+	X(RETRY_BATCH, retry_batch)
+	X(RETRY_OPS, retry_ops)
+	X(RETRY_DATA, retry_data)
 #undef X
 	return (void*)0;
 }
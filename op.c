@@ -0,0 +1,893 @@
+/*
+ *  Lib(X)SVF  -  A library for implementing SVF and XSVF JTAG players
+ *
+ *  Copyright (C) 2009  RIEGL Research ForschungsGmbH
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *  
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libxsvf.h"
+
+static int bits2bytes(int bits)
+{
+	return (bits+7) / 8;
+}
+
+static void tdo_mismatch(struct libxsvf_host *h)
+{
+	/* hosts checking TDO asynchronously may already have set the location of the failed check */
+	if (!h->error_location.command)
+		h->error_location = h->location;
+	LIBXSVF_HOST_REPORT_ERROR("TDO mismatch.");
+}
+
+/* a failed TDO check that is retried is not an error, forget where it happened */
+static void tdo_retry(struct libxsvf_host *h)
+{
+	struct libxsvf_location none = { 0, 0, 0 };
+	h->error_location = none;
+}
+
+static int op_udelay(struct libxsvf_host *h, long usecs, int tms, long num_tck)
+{
+	/* with a known TCK frequency a wait can be done by clocking in a state that is not left by this */
+	if ((h->flags & LIBXSVF_FLAG_WAIT_TCK) != 0 && h->frequency > 0 && usecs > 0 &&
+			(tms ? h->tap_state == LIBXSVF_TAP_RESET : h->tap_state == LIBXSVF_TAP_IDLE ||
+			 h->tap_state == LIBXSVF_TAP_DRPAUSE || h->tap_state == LIBXSVF_TAP_IRPAUSE)) {
+		long long factor = (long long)h->frequency * (100 + h->wait_margin);
+		long long max_usecs = (long long)(~0ULL >> 1) - 99999999;
+		long max_tck = ~0UL >> 1;
+		if (h->wait_margin < 0) {
+			LIBXSVF_HOST_REPORT_ERROR("Negative wait margin.");
+			return -1;
+		}
+		/* a wait that does not fit into num_tck is done by udelay() */
+		if (usecs <= max_usecs / factor) {
+			long long tck = ((long long)usecs * factor + 99999999) / 100000000;
+			if (tck <= max_tck) {
+				if (tck > num_tck)
+					num_tck = tck;
+				usecs = 0;
+			}
+		}
+	}
+	LIBXSVF_HOST_UDELAY(usecs, tms, num_tck);
+	return 0;
+}
+
+/* one attempt of an XSHIFT, returns 1 on a failed TDO check */
+static int xshift_once(struct libxsvf_host *h, const struct libxsvf_op *op, int sync)
+{
+	int tdo_error = 0;
+
+	if (libxsvf_tap_walk(h, op->state) < 0)
+		return -1;
+
+	if (libxsvf_tap_shift(h, op->len, op->tdi_data, op->tdi_mask, op->tdo_data,
+			op->tdo_mask, op->ret_mask, op->estate, sync) < 0)
+		tdo_error = 1;
+
+	if (op->value) {
+		if (libxsvf_tap_walk(h, LIBXSVF_TAP_IDLE) < 0)
+			return -1;
+		if (op_udelay(h, op->value, 0, op->value) < 0)
+			return -1;
+	} else {
+		if (libxsvf_tap_walk(h, op->estate) < 0)
+			return -1;
+	}
+
+	return tdo_error;
+}
+
+static int op_xshift(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	int retries = op->retries;
+	int with_retries = retries > 0;
+
+	if (with_retries && LIBXSVF_HOST_SYNC() < 0) {
+		tdo_mismatch(h);
+		return -1;
+	}
+
+	while (1)
+	{
+		int rc = xshift_once(h, op, with_retries);
+
+		if (rc <= 0)
+			return rc;
+
+		if (retries <= 0) {
+			tdo_mismatch(h);
+			return -1;
+		}
+
+		tdo_retry(h);
+		retries--;
+	}
+}
+
+static int op_play(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	long i;
+
+	switch (op->type)
+	{
+	case LIBXSVF_OP_TAP:
+		return libxsvf_tap_walk(h, op->state);
+	case LIBXSVF_OP_SHIFT:
+		if (libxsvf_tap_shift(h, op->len, op->tdi_data, op->tdi_mask, op->tdo_data,
+				op->tdo_mask, op->ret_mask, op->estate, 0) == 0)
+			return 0;
+		tdo_mismatch(h);
+		return -1;
+	case LIBXSVF_OP_XSHIFT:
+		return op_xshift(h, op);
+	case LIBXSVF_OP_UDELAY:
+		return op_udelay(h, op->value, op->tms, op->num_tck);
+	case LIBXSVF_OP_SCK:
+		for (i=0; i < op->value; i++)
+			LIBXSVF_HOST_PULSE_SCK();
+		return 0;
+	case LIBXSVF_OP_TRST:
+		LIBXSVF_HOST_SET_TRST(op->value);
+		return 0;
+	case LIBXSVF_OP_FREQUENCY:
+		h->frequency = op->value;
+		if (LIBXSVF_HOST_SET_FREQUENCY(op->value) < 0) {
+			h->frequency = 0;
+			LIBXSVF_HOST_REPORT_ERROR("FREQUENCY command failed!");
+			return -1;
+		}
+		return 0;
+	case LIBXSVF_OP_SYNC:
+		if (LIBXSVF_HOST_SYNC() != 0) {
+			tdo_mismatch(h);
+			return -1;
+		}
+		return 0;
+	}
+
+	LIBXSVF_HOST_REPORT_ERROR("Unknown operation.");
+	return -1;
+}
+
+/* store a bit array in the program data, re-using the last one stored in this slot if it is unchanged */
+static int record_data(struct libxsvf_host *h, struct libxsvf_program *prog, int slot, const unsigned char *data, int bytes)
+{
+	int i, offset;
+
+	if (!data)
+		return -1;
+
+	offset = prog->last_data[slot];
+	if (offset >= 0 && prog->last_bytes[slot] == bytes) {
+		for (i=0; i<bytes; i++)
+			if (prog->data[offset+i] != data[i])
+				break;
+		if (i == bytes)
+			return offset;
+	}
+
+	if (prog->data_num + bytes > prog->data_len) {
+		int len = prog->data_len < 1024 ? 1024 : prog->data_len*2;
+		while (len < prog->data_num + bytes)
+			len *= 2;
+		unsigned char *p = LIBXSVF_HOST_REALLOC(prog->data, len, prog->mem_data);
+		if (!p) {
+			LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+			return -2;
+		}
+		prog->data = p;
+		prog->data_len = len;
+	}
+
+	offset = prog->data_num;
+	for (i=0; i<bytes; i++)
+		prog->data[offset+i] = data[i];
+	prog->data_num += bytes;
+
+	prog->last_data[slot] = offset;
+	prog->last_bytes[slot] = bytes;
+	return offset;
+}
+
+static int op_record(struct libxsvf_host *h, struct libxsvf_program *prog, const struct libxsvf_op *op)
+{
+	const unsigned char *data[5] = { op->tdi_data, op->tdi_mask, op->tdo_data, op->tdo_mask, op->ret_mask };
+	int bytes = bits2bytes(op->len);
+	int i;
+
+	if (op->type == LIBXSVF_OP_TAP || op->type == LIBXSVF_OP_XSHIFT) {
+		if (op->state <= LIBXSVF_TAP_INIT || op->state > LIBXSVF_TAP_IRUPDATE) {
+			LIBXSVF_HOST_REPORT_ERROR("Illegal tap state.");
+			return -1;
+		}
+	}
+
+	if (prog->ops_num == prog->ops_len) {
+		int len = prog->ops_len < 64 ? 64 : prog->ops_len*2;
+		struct libxsvf_program_op *p = LIBXSVF_HOST_REALLOC(prog->ops, len * sizeof(struct libxsvf_program_op), prog->mem_ops);
+		if (!p) {
+			LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+			return -1;
+		}
+		prog->ops = p;
+		prog->ops_len = len;
+	}
+
+	struct libxsvf_program_op *pop = &prog->ops[prog->ops_num];
+	pop->op = *op;
+	pop->location = h->location;
+	pop->op.tdi_data = (void*)0;
+	pop->op.tdi_mask = (void*)0;
+	pop->op.tdo_data = (void*)0;
+	pop->op.tdo_mask = (void*)0;
+	pop->op.ret_mask = (void*)0;
+
+	for (i=0; i<5; i++) {
+		pop->data[i] = record_data(h, prog, i, data[i], bytes);
+		if (pop->data[i] < -1)
+			return -1;
+	}
+
+	prog->ops_num++;
+	return 0;
+}
+
+/* the operation at index i, with the pointers into the program data */
+static const struct libxsvf_program_op *program_op(const struct libxsvf_program *prog, int i, struct libxsvf_op *op)
+{
+	const struct libxsvf_program_op *pop = &prog->ops[i];
+	*op = pop->op;
+	if (pop->data[0] >= 0)
+		op->tdi_data = prog->data + pop->data[0];
+	if (pop->data[1] >= 0)
+		op->tdi_mask = prog->data + pop->data[1];
+	if (pop->data[2] >= 0)
+		op->tdo_data = prog->data + pop->data[2];
+	if (pop->data[3] >= 0)
+		op->tdo_mask = prog->data + pop->data[3];
+	if (pop->data[4] >= 0)
+		op->ret_mask = prog->data + pop->data[4];
+	return pop;
+}
+
+/*
+ * Batched XREPEAT retries: with h->retry_batch > 0 a shift with retries
+ * is played without syncing, like any other shift. The operations from
+ * there on are kept in a program and the TDO checks of up to retry_batch
+ * shifts are done by one sync(). When one of them failed, the player goes
+ * back to the first failed shift, retries it the normal way and plays the
+ * rest of the batch again. Operations that can not be played twice end
+ * the batch first. The program starts with the last IR shift before the
+ * batch (if it is known), so the instruction can be restored for a replay.
+ */
+struct retry_batch {
+	struct libxsvf_program prog;
+	int open, shifts, anchor, unchecked;
+};
+
+static int op_retried(const struct libxsvf_op *op)
+{
+	return op->type == LIBXSVF_OP_XSHIFT && op->retries > 0 && op->tdo_data;
+}
+
+static int op_ir_shift(const struct libxsvf_op *op)
+{
+	return op->type == LIBXSVF_OP_XSHIFT && op->state == LIBXSVF_TAP_IRSHIFT;
+}
+
+/* operations that change the instruction register without an XSHIFT */
+static int op_clobbers_ir(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	switch (op->type)
+	{
+	case LIBXSVF_OP_TAP:
+		return op->state == LIBXSVF_TAP_RESET;
+	case LIBXSVF_OP_SHIFT:
+		return h->tap_state == LIBXSVF_TAP_IRSHIFT;
+	case LIBXSVF_OP_TRST:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Operations that can be part of a batch and be played again. An IR shift
+ * is only kept when the instruction before the batch is known, so it can
+ * be restored for a replay.
+ */
+static int batch_keeps(struct libxsvf_host *h, const struct libxsvf_op *op, int anchor)
+{
+	switch (op->type)
+	{
+	case LIBXSVF_OP_XSHIFT:
+		if (op_ir_shift(op) && !anchor)
+			return 0;
+		/* fall through */
+	case LIBXSVF_OP_TAP:
+	case LIBXSVF_OP_SHIFT:
+		return !op->ret_mask && !op_clobbers_ir(h, op);
+	case LIBXSVF_OP_UDELAY:
+		return !op->tms;
+	default:
+		return 0;
+	}
+}
+
+static void batch_reset(struct retry_batch *b)
+{
+	int i;
+
+	b->prog.ops_num = 0;
+	b->prog.data_num = 0;
+	for (i=0; i<5; i++)
+		b->prog.last_data[i] = b->prog.last_bytes[i] = -1;
+	b->open = b->shifts = b->anchor = 0;
+}
+
+static struct retry_batch *batch_get(struct libxsvf_host *h)
+{
+	struct retry_batch *b = h->retry_data;
+
+	if (b)
+		return b;
+
+	b = LIBXSVF_HOST_REALLOC((void*)0, sizeof(struct retry_batch), LIBXSVF_MEM_RETRY_BATCH);
+	if (!b) {
+		LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+		return (void*)0;
+	}
+
+	libxsvf_program_init(&b->prog);
+	b->prog.mem_ops = LIBXSVF_MEM_RETRY_OPS;
+	b->prog.mem_data = LIBXSVF_MEM_RETRY_DATA;
+	batch_reset(b);
+	b->unchecked = 0;
+	h->retry_data = b;
+	return b;
+}
+
+/* starts the program again with its last IR shift (if any) as the anchor */
+static int batch_anchor(struct libxsvf_host *h, struct retry_batch *b)
+{
+	struct libxsvf_location location = h->location;
+	struct libxsvf_op op;
+	int i, rc;
+
+	for (i = b->prog.ops_num-1; i >= 0; i--)
+		if (op_ir_shift(&b->prog.ops[i].op))
+			break;
+
+	if (i < 0) {
+		batch_reset(b);
+		return 0;
+	}
+
+	/* an IR shift only has TDI data, it is copied forward to the start of the data */
+	h->location = program_op(&b->prog, i, &op)->location;
+	op.tdo_data = op.tdo_mask = op.tdi_mask = op.ret_mask = (void*)0;
+	batch_reset(b);
+	rc = op_record(h, &b->prog, &op);
+	h->location = location;
+	if (rc < 0)
+		return -1;
+
+	b->anchor = 1;
+	return 0;
+}
+
+/* the batch entry of the first failed TDO check, -1 if it is not in the batch */
+static int batch_failed(struct libxsvf_host *h, struct retry_batch *b)
+{
+	struct libxsvf_op op;
+	int i;
+
+	for (i = b->anchor; i < b->prog.ops_num; i++) {
+		const struct libxsvf_program_op *pop = program_op(&b->prog, i, &op);
+		if (h->error_location.command ? pop->location.command == h->error_location.command : op_retried(&op))
+			return i;
+	}
+
+	return -1;
+}
+
+static int batch_replay(struct libxsvf_host *h, struct retry_batch *b, int first)
+{
+	struct libxsvf_op op;
+	int i, ir = -1;
+
+	if (first >= 0)
+		program_op(&b->prog, first, &op);
+	if (first < 0 || !op_retried(&op)) {
+		tdo_mismatch(h);
+		return -1;
+	}
+
+	/*
+	 * Restore the instruction when the batch has loaded another one after
+	 * the failed shift. A batch only has IR shifts when it starts with one.
+	 */
+	for (i = first+1; i < b->prog.ops_num; i++)
+		if (op_ir_shift(&b->prog.ops[i].op))
+			break;
+	if (i < b->prog.ops_num) {
+		for (ir = first-1; ir >= 0; ir--)
+			if (op_ir_shift(&b->prog.ops[ir].op))
+				break;
+	}
+
+	tdo_retry(h);
+	h->retry_replays++;
+
+	if (ir >= 0) {
+		h->location = program_op(&b->prog, ir, &op)->location;
+		if (op_play(h, &op) < 0)
+			return -1;
+	}
+
+	for (i = first; i < b->prog.ops_num; i++) {
+		h->location = program_op(&b->prog, i, &op)->location;
+		/* the failed attempt was the first one */
+		if (i == first)
+			op.retries--;
+		if (op_play(h, &op) < 0)
+			return -1;
+	}
+
+	if (LIBXSVF_HOST_SYNC() != 0) {
+		tdo_mismatch(h);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int batch_flush(struct libxsvf_host *h, struct retry_batch *b)
+{
+	struct libxsvf_location location = h->location;
+	int rc = 0;
+
+	b->open = 0;
+	b->unchecked = 0;
+	if (LIBXSVF_HOST_SYNC() != 0) {
+		rc = batch_replay(h, b, batch_failed(h, b));
+		h->location = location;
+	}
+
+	if (rc < 0) {
+		batch_reset(b);
+		return -1;
+	}
+
+	return batch_anchor(h, b);
+}
+
+/* plays an operation of the batch without syncing, returns 1 on a failed TDO check */
+static int batch_play(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	if (op->type == LIBXSVF_OP_XSHIFT)
+		return xshift_once(h, op, 0);
+	if (op->type == LIBXSVF_OP_SHIFT)
+		return libxsvf_tap_shift(h, op->len, op->tdi_data, op->tdi_mask, op->tdo_data,
+				op->tdo_mask, op->ret_mask, op->estate, 0) < 0;
+	return op_play(h, op);
+}
+
+static int op_batch(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	struct retry_batch *b = h->retry_data;
+	int rc;
+
+	if (!b && !(b = batch_get(h)))
+		return -1;
+
+	if (b->open && !batch_keeps(h, op, b->anchor) && batch_flush(h, b) < 0)
+		return -1;
+
+	if (!b->open && !op_retried(op)) {
+		if (op_ir_shift(op)) {
+			/* the instruction for a replay of the next batch */
+			batch_reset(b);
+			if (op_record(h, &b->prog, op) < 0)
+				return -1;
+			b->anchor = 1;
+		} else if (op_clobbers_ir(h, op))
+			batch_reset(b);
+		if (op->tdo_data)
+			b->unchecked = 1;
+		if (op->type == LIBXSVF_OP_SYNC)
+			b->unchecked = 0;
+		return op_play(h, op);
+	}
+
+	if (!b->open) {
+		/* a failed check before the batch must not be mistaken for one in the batch */
+		if (b->unchecked && LIBXSVF_HOST_SYNC() != 0) {
+			tdo_mismatch(h);
+			return -1;
+		}
+		b->unchecked = 0;
+		b->open = 1;
+	}
+
+	if (op_record(h, &b->prog, op) < 0) {
+		batch_reset(b);
+		return -1;
+	}
+
+	if (op->type == LIBXSVF_OP_SHIFT || op->type == LIBXSVF_OP_XSHIFT)
+		b->shifts++;
+
+	rc = batch_play(h, op);
+	if (rc < 0) {
+		batch_reset(b);
+		return -1;
+	}
+
+	if (rc > 0 || b->shifts >= h->retry_batch)
+		return batch_flush(h, b);
+
+	return 0;
+}
+
+static int op_exec(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	if (h->retry_batch > 0 && h->sync)
+		return op_batch(h, op);
+	return op_play(h, op);
+}
+
+/* checks the TDO of the shifts that are still in a batch */
+int libxsvf_op_flush(struct libxsvf_host *h)
+{
+	struct retry_batch *b = h->retry_data;
+
+	if (!b || !b->open)
+		return 0;
+
+	return batch_flush(h, b);
+}
+
+void libxsvf_op_free(struct libxsvf_host *h)
+{
+	struct retry_batch *b = h->retry_data;
+
+	if (!b)
+		return;
+
+	libxsvf_program_free(h, &b->prog);
+	LIBXSVF_HOST_REALLOC(b, 0, LIBXSVF_MEM_RETRY_BATCH);
+	h->retry_data = (void*)0;
+}
+
+/* move the simulated TAP state for libxsvf_analyze(), counting the TCK cycles */
+static int count_walk(struct libxsvf_host *h, enum libxsvf_tap_state s)
+{
+	int len = libxsvf_tap_walk_len(h->tap_state, s);
+	if (len < 0) {
+		LIBXSVF_HOST_REPORT_ERROR("Illegal tap state.");
+		return -1;
+	}
+	h->stats->tck += len;
+	h->stats->frequency_tck += len;
+	h->tap_state = s;
+	return 0;
+}
+
+static void count_shift(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	struct libxsvf_stats *stats = h->stats;
+	int i;
+
+	stats->tck += op->len;
+	stats->frequency_tck += op->len;
+
+	if (op->tdo_data && op->tdo_mask) {
+		for (i=0; i < bits2bytes(op->len); i++) {
+			int v = op->tdo_mask[i] & (i == 0 && op->len % 8 ? (1 << op->len % 8) - 1 : 0xff);
+			while (v) {
+				stats->tdo_bits++;
+				v &= v-1;
+			}
+		}
+	} else if (op->tdo_data)
+		stats->tdo_bits += op->len;
+
+	if (op->len > 0 && h->tap_state != op->estate)
+		h->tap_state++;
+}
+
+/* add the TCK cycles clocked at the current frequency to the runtime estimate */
+static void count_frequency(struct libxsvf_stats *stats)
+{
+	if (stats->frequency > 0)
+		stats->usecs += (stats->frequency_tck * 1000000 + stats->frequency - 1) / stats->frequency;
+	stats->frequency_tck = 0;
+}
+
+/*
+ * add a wait to the runtime estimate: the host waits for the TCK cycles and
+ * the time at once, so it takes as long as the longer of both
+ */
+static void count_wait(struct libxsvf_stats *stats, long num_tck, long usecs)
+{
+	long long wait = usecs;
+
+	stats->tck += num_tck;
+	stats->wait_usecs += usecs;
+
+	if (stats->frequency > 0) {
+		long long tck_usecs = ((long long)num_tck * 1000000 + stats->frequency - 1) / stats->frequency;
+		if (tck_usecs > wait)
+			wait = tck_usecs;
+	}
+	stats->usecs += wait;
+}
+
+static int op_count(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	struct libxsvf_stats *stats = h->stats;
+
+	switch (op->type)
+	{
+	case LIBXSVF_OP_TAP:
+		return count_walk(h, op->state);
+	case LIBXSVF_OP_SHIFT:
+		count_shift(h, op);
+		return 0;
+	case LIBXSVF_OP_XSHIFT:
+		/* retries are only needed on a failed TDO check, so they are not counted */
+		if (count_walk(h, op->state) < 0)
+			return -1;
+		count_shift(h, op);
+		if (op->value) {
+			if (count_walk(h, LIBXSVF_TAP_IDLE) < 0)
+				return -1;
+			count_wait(stats, op->value, op->value);
+			return 0;
+		}
+		return count_walk(h, op->estate);
+	case LIBXSVF_OP_UDELAY:
+		count_wait(stats, op->num_tck, op->value);
+		return 0;
+	case LIBXSVF_OP_SCK:
+		stats->sck += op->value;
+		return 0;
+	case LIBXSVF_OP_FREQUENCY:
+		count_frequency(stats);
+		stats->frequency = op->value;
+		return 0;
+	case LIBXSVF_OP_TRST:
+	case LIBXSVF_OP_SYNC:
+		return 0;
+	}
+
+	LIBXSVF_HOST_REPORT_ERROR("Unknown operation.");
+	return -1;
+}
+
+/*
+ * Commands before the checkpoint of libxsvf_resume() are only parsed. The
+ * last FREQUENCY and TRST among them are kept, libxsvf_op_resume() applies
+ * them before the first command that is played.
+ */
+static int op_skip(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	if (op->type == LIBXSVF_OP_FREQUENCY)
+		h->resume_frequency = *op;
+	if (op->type == LIBXSVF_OP_TRST)
+		h->resume_trst = *op;
+	return 0;
+}
+
+int libxsvf_op_resume(struct libxsvf_host *h)
+{
+	struct libxsvf_op frequency = h->resume_frequency, trst = h->resume_trst;
+
+	h->resume_frequency.type = 0;
+	h->resume_trst.type = 0;
+
+	if (frequency.type && libxsvf_op(h, &frequency) < 0)
+		return -1;
+	if (trst.type && libxsvf_op(h, &trst) < 0)
+		return -1;
+	return 0;
+}
+
+int libxsvf_op(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	if (h->resume)
+		return op_skip(h, op);
+	if (h->stats)
+		return op_count(h, op);
+	if (h->program)
+		return op_record(h, h->program, op);
+	if (h->put_op)
+		return LIBXSVF_HOST_PUT_OP(op);
+	return op_exec(h, op);
+}
+
+int libxsvf_execute_op(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	return op_exec(h, op);
+}
+
+int libxsvf_op_tap(struct libxsvf_host *h, enum libxsvf_tap_state state)
+{
+	struct libxsvf_op op = { LIBXSVF_OP_TAP, state };
+	return libxsvf_op(h, &op);
+}
+
+int libxsvf_op_shift(struct libxsvf_host *h, int len, const unsigned char *tdi_data, const unsigned char *tdi_mask,
+		const unsigned char *tdo_data, const unsigned char *tdo_mask, const unsigned char *ret_mask,
+		enum libxsvf_tap_state estate)
+{
+	struct libxsvf_op op = { LIBXSVF_OP_SHIFT, 0, estate, len };
+	op.tdi_data = tdi_data;
+	op.tdi_mask = tdi_mask;
+	op.tdo_data = tdo_data;
+	op.tdo_mask = tdo_mask;
+	op.ret_mask = ret_mask;
+	return libxsvf_op(h, &op);
+}
+
+int libxsvf_op_xshift(struct libxsvf_host *h, int len, const unsigned char *tdi_data,
+		const unsigned char *tdo_data, const unsigned char *tdo_mask,
+		enum libxsvf_tap_state state, enum libxsvf_tap_state estate, long edelay, int retries)
+{
+	struct libxsvf_op op = { LIBXSVF_OP_XSHIFT, state, estate, len, 0, retries, edelay };
+	op.tdi_data = tdi_data;
+	op.tdo_data = tdo_data;
+	op.tdo_mask = tdo_mask;
+	return libxsvf_op(h, &op);
+}
+
+int libxsvf_op_udelay(struct libxsvf_host *h, long usecs, int tms, long num_tck)
+{
+	struct libxsvf_op op = { LIBXSVF_OP_UDELAY, 0, 0, 0, tms, 0, usecs, num_tck };
+	return libxsvf_op(h, &op);
+}
+
+int libxsvf_op_sck(struct libxsvf_host *h, long count)
+{
+	struct libxsvf_op op = { LIBXSVF_OP_SCK, 0, 0, 0, 0, 0, count };
+	return libxsvf_op(h, &op);
+}
+
+int libxsvf_op_trst(struct libxsvf_host *h, int v)
+{
+	struct libxsvf_op op = { LIBXSVF_OP_TRST, 0, 0, 0, 0, 0, v };
+	return libxsvf_op(h, &op);
+}
+
+int libxsvf_op_frequency(struct libxsvf_host *h, long v)
+{
+	struct libxsvf_op op = { LIBXSVF_OP_FREQUENCY, 0, 0, 0, 0, 0, v };
+	return libxsvf_op(h, &op);
+}
+
+int libxsvf_op_sync(struct libxsvf_host *h)
+{
+	struct libxsvf_op op = { LIBXSVF_OP_SYNC };
+	return libxsvf_op(h, &op);
+}
+
+int libxsvf_program_play(struct libxsvf_host *h, const struct libxsvf_program *prog)
+{
+	struct libxsvf_op op;
+	int i;
+
+	for (i=0; i < prog->ops_num; i++)
+	{
+		h->location = program_op(prog, i, &op)->location;
+		if (op_exec(h, &op) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Plays the body of an SVF LOOP again and again until it runs without a TDO
+ * mismatch, at most count times. A mismatch ends the current pass right away,
+ * so TDO is checked synchronously (like XSDR retries do).
+ */
+int libxsvf_program_loop(struct libxsvf_host *h, const struct libxsvf_program *prog, long count)
+{
+	struct libxsvf_op op;
+	long n;
+	int i;
+
+	if (LIBXSVF_HOST_SYNC() != 0) {
+		tdo_mismatch(h);
+		return -1;
+	}
+
+	for (n=0; n < count; n++)
+	{
+		int tdo_error = 0;
+
+		for (i=0; i < prog->ops_num && !tdo_error; i++)
+		{
+			h->location = program_op(prog, i, &op)->location;
+			if (op.type == LIBXSVF_OP_SHIFT && op.tdo_data) {
+				if (libxsvf_tap_shift(h, op.len, op.tdi_data, op.tdi_mask, op.tdo_data,
+						op.tdo_mask, op.ret_mask, op.estate, 1) < 0)
+					tdo_error = 1;
+				continue;
+			}
+			if (op_exec(h, &op) < 0)
+				return -1;
+		}
+
+		if (!tdo_error)
+			return 0;
+		tdo_retry(h);
+	}
+
+	tdo_mismatch(h);
+	return -1;
+}
+
+/*
+ * Reads the status register described by 'poll' and walks back to 'state'.
+ * Returns 1 when it has the ready value, 0 when not and -1 on errors.
+ */
+int libxsvf_op_poll(struct libxsvf_host *h, const struct libxsvf_poll *poll, enum libxsvf_tap_state state)
+{
+	int ready = 1;
+
+	if (libxsvf_tap_walk(h, LIBXSVF_TAP_IRSHIFT) < 0)
+		return -1;
+	libxsvf_tap_shift(h, poll->ir_len, poll->ir_tdi, (void*)0, (void*)0, (void*)0, (void*)0, LIBXSVF_TAP_IREXIT1, 0);
+	if (libxsvf_tap_walk(h, LIBXSVF_TAP_DRSHIFT) < 0)
+		return -1;
+	if (libxsvf_tap_shift(h, poll->dr_len, (void*)0, (void*)0, poll->dr_tdo, poll->dr_mask,
+			(void*)0, LIBXSVF_TAP_DREXIT1, 1) < 0) {
+		tdo_retry(h);
+		ready = 0;
+	}
+	if (libxsvf_tap_walk(h, state) < 0)
+		return -1;
+
+	return ready;
+}
+
+void libxsvf_program_init(struct libxsvf_program *prog)
+{
+	int i;
+
+	prog->ops = (void*)0;
+	prog->data = (void*)0;
+	prog->ops_num = prog->ops_len = 0;
+	prog->data_num = prog->data_len = 0;
+	for (i=0; i<5; i++)
+		prog->last_data[i] = prog->last_bytes[i] = -1;
+	prog->mem_ops = LIBXSVF_MEM_PROGRAM_OPS;
+	prog->mem_data = LIBXSVF_MEM_PROGRAM_DATA;
+}
+
+void libxsvf_program_free(struct libxsvf_host *h, struct libxsvf_program *prog)
+{
+	LIBXSVF_HOST_REALLOC(prog->ops, 0, prog->mem_ops);
+	LIBXSVF_HOST_REALLOC(prog->data, 0, prog->mem_data);
+	prog->ops = (void*)0;
+	prog->data = (void*)0;
+	prog->ops_num = prog->ops_len = 0;
+	prog->data_num = prog->data_len = 0;
+}
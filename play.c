@@ -20,21 +20,90 @@
 
 #include "libxsvf.h"
 
-int libxsvf_play(struct libxsvf_host *h, enum libxsvf_mode mode)
+int libxsvf_open(struct libxsvf_host *h)
 {
-	int rc = -1;
-
 	h->tap_state = LIBXSVF_TAP_INIT;
+	h->retry_data = (void*)0;
 	if (LIBXSVF_HOST_SETUP() < 0) {
 		LIBXSVF_HOST_REPORT_ERROR("Setup of JTAG interface failed.");
 		return -1;
 	}
+	return 0;
+}
+
+enum run_state {
+	RUN_IDLE = 0,
+	RUN_PLAY = 1,
+	RUN_FINISH = 2
+};
+
+static int run_end(struct libxsvf_host *h, int rc);
+
+static int run_finish(struct libxsvf_host *h)
+{
+	int rc = h->run_rc;
+
+#ifndef LIBXSVF_WITHOUT_SVF
+	if (h->run_mode == LIBXSVF_MODE_SVF)
+		rc = libxsvf_svf_finish(h, rc);
+#endif
+
+#ifndef LIBXSVF_WITHOUT_XSVF
+	if (h->run_mode == LIBXSVF_MODE_XSVF)
+		rc = libxsvf_xsvf_finish(h, rc);
+#endif
+
+	h->run_state = RUN_IDLE;
+	h->push_mode = 0;
+
+	return run_end(h, rc);
+}
+
+static int run_end(struct libxsvf_host *h, int rc)
+{
+	if (rc >= 0 && libxsvf_op_flush(h) < 0)
+		rc = -1;
+	libxsvf_op_free(h);
+
+	if ((h->flags & LIBXSVF_FLAG_KEEP_TAPSTATE) == 0)
+		libxsvf_tap_walk(h, LIBXSVF_TAP_RESET);
+	if (LIBXSVF_HOST_SYNC() != 0 && rc >= 0 ) {
+		LIBXSVF_HOST_REPORT_ERROR("TDO mismatch in TAP reset. (this is not possible!)");
+		rc = -1;
+	}
+
+	return rc;
+}
+
+static void location_reset(struct libxsvf_host *h)
+{
+	struct libxsvf_location none = { 0, 0, 0 };
+	h->location = none;
+	h->error_location = none;
+}
+
+static int run_start(struct libxsvf_host *h, enum libxsvf_mode mode, int push_mode)
+{
+	int rc = -1;
+
+	location_reset(h);
+	h->shift_same = 0;
+	h->skipped_ir_bits = 0;
+	h->retry_replays = 0;
+	h->block_len = h->block_pos = 0;
+	h->block_offset = 0;
+	h->push_mode = push_mode;
+	h->push_eof = 0;
+	h->run_mode = mode;
+	h->run_state = RUN_IDLE;
+	h->run_rc = 0;
+	h->run_data = (void*)0;
 
 	if (mode == LIBXSVF_MODE_SVF) {
 #ifdef LIBXSVF_WITHOUT_SVF
 		LIBXSVF_HOST_REPORT_ERROR("SVF support in libxsvf is disabled.");
 #else
-		rc = libxsvf_svf(h);
+		rc = libxsvf_svf_start(h);
 #endif
 	}
 
@@ -42,7 +111,7 @@ int libxsvf_play(struct libxsvf_host *h, enum libxsvf_mode mode)
 #ifdef LIBXSVF_WITHOUT_XSVF
 		LIBXSVF_HOST_REPORT_ERROR("XSVF support in libxsvf is disabled.");
 #else
-		rc = libxsvf_xsvf(h);
+		rc = libxsvf_xsvf_start(h);
 #endif
 	}
 
@@ -50,14 +119,211 @@ int libxsvf_play(struct libxsvf_host *h, enum libxsvf_mode mode)
 #ifdef LIBXSVF_WITHOUT_SCAN
 		LIBXSVF_HOST_REPORT_ERROR("SCAN support in libxsvf is disabled.");
 #else
-		rc = libxsvf_scan(h);
+		rc = 0;
 #endif
 	}
 
-	libxsvf_tap_walk(h, LIBXSVF_TAP_RESET);
-	if (LIBXSVF_HOST_SYNC() != 0 && rc >= 0 ) {
-		LIBXSVF_HOST_REPORT_ERROR("TDO mismatch in TAP reset. (this is not possible!)");
-		rc = -1;
+	if (rc < 0) {
+		h->run_rc = -1;
+		run_finish(h);
+		return -1;
+	}
+
+	h->run_state = RUN_PLAY;
+	return 0;
+}
+
+int libxsvf_run(struct libxsvf_host *h, enum libxsvf_mode mode)
+{
+	int rc;
+
+	if (run_start(h, mode, 0) < 0)
+		return -1;
+
+	do {
+		rc = libxsvf_step(h);
+	} while (rc > 0);
+
+	return rc;
+}
+
+int libxsvf_start(struct libxsvf_host *h, enum libxsvf_mode mode)
+{
+	return run_start(h, mode, 1);
+}
+
+void libxsvf_feed(struct libxsvf_host *h, const unsigned char *buf, int len)
+{
+	h->block_offset += h->block_len;
+	h->block = buf;
+	h->block_len = len > 0 ? len : 0;
+	h->block_pos = 0;
+	if (len <= 0)
+		h->push_eof = 1;
+}
+
+int libxsvf_step(struct libxsvf_host *h)
+{
+	int rc = LIBXSVF_STEP_ERROR;
+
+	if (h->run_state == RUN_PLAY)
+	{
+#ifndef LIBXSVF_WITHOUT_SVF
+		if (h->run_mode == LIBXSVF_MODE_SVF)
+			rc = libxsvf_svf_step(h);
+#endif
+
+#ifndef LIBXSVF_WITHOUT_XSVF
+		if (h->run_mode == LIBXSVF_MODE_XSVF)
+			rc = libxsvf_xsvf_step(h);
+#endif
+
+#ifndef LIBXSVF_WITHOUT_SCAN
+		if (h->run_mode == LIBXSVF_MODE_SCAN)
+			rc = libxsvf_scan(h) < 0 ? LIBXSVF_STEP_ERROR : LIBXSVF_STEP_DONE;
+#endif
+
+		if (rc != LIBXSVF_STEP_DONE && rc != LIBXSVF_STEP_ERROR)
+			return rc;
+
+		h->run_rc = rc == LIBXSVF_STEP_DONE ? 0 : -1;
+		h->run_state = RUN_FINISH;
+
+		if (h->push_mode && h->sync)
+			return LIBXSVF_STEP_NEED_SYNC;
+	}
+
+	if (h->run_state == RUN_FINISH)
+		return run_finish(h) < 0 ? LIBXSVF_STEP_ERROR : LIBXSVF_STEP_DONE;
+
+	LIBXSVF_HOST_REPORT_ERROR("No file is being played.");
+	return LIBXSVF_STEP_ERROR;
+}
+
+/* read a file without using the JTAG interface, the operations go to h->program, h->stats or h->put_op() */
+static int parse_only(struct libxsvf_host *h, enum libxsvf_mode mode)
+{
+	int rc = -1;
+
+	location_reset(h);
+	h->skipped_ir_bits = 0;
+	h->block_len = h->block_pos = 0;
+	h->block_offset = 0;
+	h->push_mode = 0;
+
+	if (mode == LIBXSVF_MODE_SVF) {
+#ifdef LIBXSVF_WITHOUT_SVF
+		LIBXSVF_HOST_REPORT_ERROR("SVF support in libxsvf is disabled.");
+#else
+		rc = libxsvf_svf(h);
+#endif
+	}
+
+	if (mode == LIBXSVF_MODE_XSVF) {
+#ifdef LIBXSVF_WITHOUT_XSVF
+		LIBXSVF_HOST_REPORT_ERROR("XSVF support in libxsvf is disabled.");
+#else
+		rc = libxsvf_xsvf(h);
+#endif
+	}
+
+	if (mode == LIBXSVF_MODE_SCAN)
+		LIBXSVF_HOST_REPORT_ERROR("SCAN mode needs the JTAG interface.");
+
+	return rc;
+}
+
+int libxsvf_compile(struct libxsvf_host *h, struct libxsvf_program *prog, enum libxsvf_mode mode)
+{
+	int rc;
+
+	libxsvf_program_init(prog);
+	h->program = prog;
+	rc = parse_only(h, mode);
+	h->program = (void*)0;
+
+	if (rc < 0)
+		libxsvf_program_free(h, prog);
+
+	return rc;
+}
+
+static void *analyze_realloc(struct libxsvf_host *h, void *ptr, int size, enum libxsvf_mem which)
+{
+	if (size > h->stats->mem_max[which])
+		h->stats->mem_max[which] = size;
+	return h->stats->host_realloc(h, ptr, size, which);
+}
+
+int libxsvf_analyze(struct libxsvf_host *h, struct libxsvf_stats *stats, enum libxsvf_mode mode)
+{
+	enum libxsvf_tap_state tap_state = h->tap_state;
+	int i, rc;
+
+	stats->tck = stats->sck = stats->tdo_bits = 0;
+	stats->wait_usecs = stats->usecs = 0;
+	stats->frequency_tck = 0;
+	for (i=0; i<LIBXSVF_MEM_NUM; i++)
+		stats->mem_max[i] = 0;
+	stats->host_realloc = h->realloc;
+
+	h->realloc = analyze_realloc;
+	h->stats = stats;
+	rc = parse_only(h, mode);
+
+	/* the TAP reset done by libxsvf_run() at the end of the file */
+	if (rc >= 0 && (h->flags & LIBXSVF_FLAG_KEEP_TAPSTATE) == 0)
+		libxsvf_op_tap(h, LIBXSVF_TAP_RESET);
+
+	/* adds the TCK cycles since the last FREQUENCY command to the runtime estimate */
+	libxsvf_op_frequency(h, stats->frequency);
+	h->stats = (void*)0;
+	h->realloc = stats->host_realloc;
+	h->tap_state = tap_state;
+
+	return rc;
+}
+
+int libxsvf_parse(struct libxsvf_host *h, enum libxsvf_mode mode)
+{
+	int rc;
+
+	if (!h->put_op) {
+		LIBXSVF_HOST_REPORT_ERROR("Parsing a file needs the put_op() callback.");
+		return -1;
+	}
+
+	rc = parse_only(h, mode);
+
+	/* the TAP reset and the final TDO check done by libxsvf_run() at the end of the file */
+	if (rc >= 0 && (h->flags & LIBXSVF_FLAG_KEEP_TAPSTATE) == 0)
+		rc = libxsvf_op_tap(h, LIBXSVF_TAP_RESET);
+	if (rc >= 0)
+		rc = libxsvf_op_sync(h);
+
+	return rc;
+}
+
+int libxsvf_execute(struct libxsvf_host *h, const struct libxsvf_program *prog)
+{
+	location_reset(h);
+	h->shift_same = 0;
+	h->retry_replays = 0;
+	return run_end(h, libxsvf_program_play(h, prog));
+}
+
+int libxsvf_close(struct libxsvf_host *h)
+{
+	int rc = 0;
+
+	libxsvf_op_free(h);
+
+	if (h->tap_state != LIBXSVF_TAP_INIT && h->tap_state != LIBXSVF_TAP_RESET) {
+		libxsvf_tap_walk(h, LIBXSVF_TAP_RESET);
+		if (LIBXSVF_HOST_SYNC() != 0) {
+			LIBXSVF_HOST_REPORT_ERROR("TDO mismatch in TAP reset. (this is not possible!)");
+			rc = -1;
+		}
 	}
 
 	int shutdown_rc = LIBXSVF_HOST_SHUTDOWN();
@@ -70,3 +336,117 @@ int libxsvf_play(struct libxsvf_host *h, enum libxsvf_mode mode)
 	return rc;
 }
 
+/*
+ * Called by the parsers before a command that is a safe place to start
+ * again: it shifts a new instruction, so the instruction register does
+ * not depend on the commands before. Returns 1 where libxsvf_resume()
+ * starts playing again.
+ */
+int libxsvf_checkpoint(struct libxsvf_host *h)
+{
+	struct libxsvf_checkpoint cp;
+	int rc = 0;
+
+	cp.location = h->location;
+
+	if (h->resume) {
+		if (cp.location.command < h->resume->location.command)
+			return 0;
+		if (cp.location.command != h->resume->location.command || cp.location.offset != h->resume->location.offset) {
+			LIBXSVF_HOST_REPORT_ERROR("Checkpoint does not match the file.");
+			return -1;
+		}
+		h->resume = (void*)0;
+		if (libxsvf_op_resume(h) < 0)
+			return -1;
+		rc = 1;
+	}
+
+	/* the TAP state is only known when playing or analyzing */
+	if (h->program || h->put_op)
+		return rc;
+
+	/*
+	 * the commands before a checkpoint must have passed their TDO checks,
+	 * an asynchronous host may still have some of them queued
+	 */
+	if (h->checkpoint && !h->stats && (libxsvf_op_flush(h) < 0 || libxsvf_op_sync(h) < 0))
+		return -1;
+
+	return LIBXSVF_HOST_CHECKPOINT(&cp) < 0 ? -1 : rc;
+}
+
+int libxsvf_resume(struct libxsvf_host *h, enum libxsvf_mode mode, const struct libxsvf_checkpoint *cp)
+{
+	int rc;
+
+	h->resume = cp;
+	h->resume_frequency.type = 0;
+	h->resume_trst.type = 0;
+	rc = libxsvf_run(h, mode);
+	if (h->resume && rc >= 0) {
+		LIBXSVF_HOST_REPORT_ERROR("Checkpoint not found in the file.");
+		rc = -1;
+	}
+	h->resume = (void*)0;
+
+	return rc;
+}
+
+int libxsvf_play(struct libxsvf_host *h, enum libxsvf_mode mode)
+{
+	if (libxsvf_open(h) < 0)
+		return -1;
+
+	int rc = libxsvf_run(h, mode);
+	int close_rc = libxsvf_close(h);
+
+	return rc < 0 ? rc : close_rc;
+}
+
+int libxsvf_getbyte(struct libxsvf_host *h)
+{
+	if (h->push_mode)
+		return h->push_eof ? -1 : -2;
+
+	if (!h->getblock) {
+		int ch = LIBXSVF_HOST_GETBYTE();
+		if (ch >= 0)
+			h->block_offset++;
+		return ch;
+	}
+
+	if (h->block_pos >= h->block_len) {
+		h->block_offset += h->block_len;
+		h->block_pos = 0;
+		h->block_len = LIBXSVF_HOST_GETBLOCK(&h->block);
+		if (h->block_len <= 0) {
+			h->block_len = 0;
+			return -1;
+		}
+	}
+
+	return h->block[h->block_pos++];
+}
+
+int libxsvf_read(struct libxsvf_host *h, unsigned char *buf, int len)
+{
+	int i = 0;
+
+	while (i < len) {
+		if (h->block_pos < h->block_len) {
+			int n = h->block_len - h->block_pos;
+			if (n > len - i)
+				n = len - i;
+			while (n--)
+				buf[i++] = h->block[h->block_pos++];
+			continue;
+		}
+		int ch = libxsvf_getbyte(h);
+		if (ch < 0)
+			return -1;
+		buf[i++] = ch;
+	}
+
+	return len;
+}
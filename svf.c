@@ -20,28 +20,184 @@
 
 #include "libxsvf.h"
 
-static int read_command(struct libxsvf_host *h, char **buffer_p, int *len_p)
+struct bitdata_s {
+	int len, alloced_len;
+	int alloced_bytes;
+	unsigned char *tdi_data;
+	unsigned char *tdi_mask;
+	unsigned char *tdo_data;
+	unsigned char *tdo_mask;
+	unsigned char *ret_mask;
+	int has_tdo_data;
+	int changed;
+};
+
+struct svf_state {
+	char *command_buffer;
+	int command_buffer_len;
+	int command_len;
+	int braket_mode;
+	int in_comment;
+	long line, command_line, command_offset;
+	unsigned char *stream_data;
+	int stream_bytes, stream_digits, stream_first;
+	int stream_nibble, stream_changed, stream_bit;
+	struct bitdata_s *stream_bd;
+	struct bitdata_s bd_hdr, bd_hir, bd_tdr, bd_tir, bd_sdr, bd_sir;
+	struct bitdata_s bd_drscan, bd_irscan;
+	int drscan_layout[6], irscan_layout[6];
+	int state_endir, state_enddr;
+	int state_run, state_endrun;
+	struct libxsvf_program loop_prog;
+	long loop_count;
+	int in_loop;
+	int ir_known;
+};
+
+/* character classes used by read_command(), bytes not listed are SVF_CH_PLAIN */
+enum svf_chclass {
+	SVF_CH_PLAIN = 0,
+	SVF_CH_LOWER,
+	SVF_CH_SPACE,
+	SVF_CH_NEWLINE,
+	SVF_CH_COMMENT,
+	SVF_CH_SLASH,
+	SVF_CH_SEMICOLON,
+	SVF_CH_OPEN,
+	SVF_CH_CLOSE
+};
+
+#define __ SVF_CH_PLAIN
+#define LC SVF_CH_LOWER
+#define SP SVF_CH_SPACE
+#define NL SVF_CH_NEWLINE
+#define CM SVF_CH_COMMENT
+#define SL SVF_CH_SLASH
+#define SC SVF_CH_SEMICOLON
+#define OP SVF_CH_OPEN
+#define CL SVF_CH_CLOSE
+static const unsigned char svf_chclass[256] = {
+	SP, SP, SP, SP, SP, SP, SP, SP, SP, SP, NL, SP, SP, SP, SP, SP,
+	SP, SP, SP, SP, SP, SP, SP, SP, SP, SP, SP, SP, SP, SP, SP, SP,
+	SP, CM, __, __, __, __, __, __, OP, CL, __, __, __, __, __, SL,
+	__, __, __, __, __, __, __, __, __, __, __, SC, __, __, __, __,
+	__, __, __, __, __, __, __, __, __, __, __, __, __, __, __, __,
+	__, __, __, __, __, __, __, __, __, __, __, __, __, __, __, __,
+	__, LC, LC, LC, LC, LC, LC, LC, LC, LC, LC, LC, LC, LC, LC, LC,
+	LC, LC, LC, LC, LC, LC, LC, LC, LC, LC, LC, __, __, __, __, __
+};
+#undef __
+#undef LC
+#undef SP
+#undef NL
+#undef CM
+#undef SL
+#undef SC
+#undef OP
+#undef CL
+
+/* nibble value of the characters '0'..'F', 0xff for the gap in between */
+static const unsigned char hex_table['F' - '0' + 1] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	10, 11, 12, 13, 14, 15
+};
+
+#define HEX_VALUE(_ch) ((unsigned char)((_ch) - '0') <= 'F' - '0' ? \
+		hex_table[(unsigned char)((_ch) - '0')] : 0xff)
+
+/*
+ * Bit vectors are decoded by read_command() while the command is being read,
+ * so the command buffer never holds the hex digits. The digits are written
+ * where a vector of the usual (len+3)/4 digits ends up, and compared against
+ * the old contents on the way. Other digit counts are fixed up by
+ * stream_finish() and always count as a change.
+ */
+static int stream_start(struct libxsvf_host *h, struct svf_state *st, int p);
+
+static void stream_digit(struct svf_state *st, int value)
+{
+	unsigned char *d = st->stream_data;
+	int i, k = st->stream_digits;
+
+	if (st->stream_bytes == 0)
+		return;
+
+	/* more digits than fit: drop the leading one */
+	if (k == st->stream_bytes*2) {
+		for (i=0; i<st->stream_bytes-1; i++)
+			d[i] = (d[i] << 4) | (d[i+1] >> 4);
+		d[i] = d[i] << 4;
+		st->stream_nibble = d[i] >> 4;
+		st->stream_changed = 1;
+		k--;
+	}
+
+	if (k % 2 == 0) {
+		st->stream_nibble = value;
+	} else {
+		value |= st->stream_nibble << 4;
+		st->stream_changed |= d[k/2] ^ value;
+		d[k/2] = value;
+	}
+	st->stream_digits = k+1;
+}
+
+static void stream_finish(struct svf_state *st)
+{
+	unsigned char *d = st->stream_data;
+	int shift = st->stream_bytes*2 - st->stream_digits;
+	int i, j;
+
+	if (shift > 0) {
+		if (st->stream_digits % 2)
+			d[st->stream_digits/2] = st->stream_nibble << 4;
+		if (st->stream_first)
+			d[0] &= 0x0f;
+		/* right-align the digits and clear everything in front of them */
+		for (i=st->stream_bytes-1; i>=0; i--) {
+			j = i - shift/2;
+			if (shift % 2 == 0)
+				d[i] = j >= 0 ? d[j] : 0;
+			else
+				d[i] = (j >= 1 ? d[j-1] << 4 : 0) | (j >= 0 ? d[j] >> 4 : 0);
+		}
+		st->stream_changed = 1;
+	}
+
+	if (st->stream_changed)
+		st->stream_bd->changed |= st->stream_bit;
+	st->stream_data = (void*)0;
+}
+
+/* returns 1 for a complete command, 0 on EOF, 2 if more input must be fed first and -1 on error */
+static int read_command(struct libxsvf_host *h, struct svf_state *st)
 {
-	char *buffer = *buffer_p;
-	int braket_mode = 0;
-	int len = *len_p;
-	int p = 0;
+	char *buffer = st->command_buffer;
+	int braket_mode = st->braket_mode;
+	int len = st->command_buffer_len;
+	int p = st->command_len;
+	int ch, i, n;
+
+	if (st->in_comment)
+		goto skip_to_eol;
 
 	while (1)
 	{
 		if (len < p+10) {
 			len = len < 64 ? 96 : len*2;
 			buffer = LIBXSVF_HOST_REALLOC(buffer, len, LIBXSVF_MEM_SVF_COMMANDBUF);
-			*buffer_p = buffer;
-			*len_p = len;
+			st->command_buffer = buffer;
+			st->command_buffer_len = len;
 			if (!buffer) {
 				LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
 				return -1;
 			}
 		}
-		buffer[p] = 0;
 
-		int ch = LIBXSVF_HOST_GETBYTE();
+		ch = LIBXSVF_GETBYTE();
+		if (ch == -2)
+			goto need_input;
 		if (ch < 0) {
 handle_eof:
 			if (p == 0)
@@ -49,44 +205,135 @@ handle_eof:
 			LIBXSVF_HOST_REPORT_ERROR("Unexpected EOF.");
 			return -1;
 		}
-		if (ch <= ' ') {
+
+		switch (svf_chclass[ch])
+		{
+		case SVF_CH_NEWLINE:
+			st->line++;
+			/* fall through */
+		case SVF_CH_SPACE:
 insert_eol:
 			if (!braket_mode && p > 0 && buffer[p-1] != ' ')
 				buffer[p++] = ' ';
 			continue;
-		}
-		if (ch == '!') {
+		case SVF_CH_SLASH:
+			if (p == 0 || buffer[p-1] != '/')
+				break;
+			p--;
+			/* fall through */
+		case SVF_CH_COMMENT:
 skip_to_eol:
+			st->in_comment = 1;
 			while (1) {
-				ch = LIBXSVF_HOST_GETBYTE();
+				/* skip over the comment text in the current input block in one go */
+				while (h->block_pos < h->block_len && (h->block[h->block_pos] >= ' ' || h->block[h->block_pos] == '\t'))
+					h->block_pos++;
+				ch = LIBXSVF_GETBYTE();
+				if (ch == -2)
+					goto need_input;
 				if (ch < 0)
 					goto handle_eof;
-				if (ch < ' ' && ch != '\t')
+				if (ch < ' ' && ch != '\t') {
+					if (ch == '\n')
+						st->line++;
+					st->in_comment = 0;
 					goto insert_eol;
+				}
 			}
+		case SVF_CH_SEMICOLON:
+			goto complete;
 		}
-		if (ch == '/' && p > 0 && buffer[p-1] == '/') {
-			p--;
-			goto skip_to_eol;
+
+		if (p == 0) {
+			st->command_line = st->line;
+			st->command_offset = h->block_offset + h->block_pos - 1;
 		}
-		if (ch == ';')
-			break;
-		if (ch == '(') {
+
+		switch (svf_chclass[ch])
+		{
+		case SVF_CH_OPEN:
 			if (!braket_mode && p > 0 && buffer[p-1] != ' ')
 				buffer[p++] = ' ';
-			braket_mode++;
-		}
-		if (ch >= 'a' && ch <= 'z')
-			buffer[p++] = ch - ('a' - 'A');
-		else
 			buffer[p++] = ch;
-		if (ch == ')') {
+			if (!braket_mode++) {
+				i = stream_start(h, st, p);
+				if (i < 0)
+					return -1;
+				if (i > 0)
+					buffer[p++] = '*';
+			}
+			continue;
+		case SVF_CH_CLOSE:
+			buffer[p++] = ch;
 			braket_mode--;
-			if (!braket_mode)
+			if (!braket_mode) {
+				if (st->stream_data)
+					stream_finish(st);
 				buffer[p++] = ' ';
+			}
+			continue;
+		case SVF_CH_LOWER:
+			ch -= 'a' - 'A';
+			break;
+		}
+
+		if (st->stream_data && HEX_VALUE(ch) != 0xff) {
+			stream_digit(st, HEX_VALUE(ch));
+
+			/* decode the following digits straight out of the current input block */
+			unsigned char *d = st->stream_data;
+			int k = st->stream_digits, cap = st->stream_bytes*2;
+			int nibble = st->stream_nibble, changed = 0;
+			n = h->block_len - h->block_pos;
+			for (i = 0; i < n && k < cap; i++, k++) {
+				ch = h->block[h->block_pos + i];
+				if (svf_chclass[ch] == SVF_CH_LOWER)
+					ch -= 'a' - 'A';
+				ch = HEX_VALUE(ch);
+				if (ch == 0xff)
+					break;
+				if (k % 2 == 0) {
+					nibble = ch;
+				} else {
+					ch |= nibble << 4;
+					changed |= d[k/2] ^ ch;
+					d[k/2] = ch;
+				}
+			}
+			st->stream_digits = k;
+			st->stream_nibble = nibble;
+			st->stream_changed |= changed;
+			h->block_pos += i;
+			continue;
+		}
+
+		buffer[p++] = ch;
+
+		/* copy the rest of the token straight out of the current input block */
+		n = h->block_len - h->block_pos;
+		if (n > len - p - 10)
+			n = len - p - 10;
+		for (i = 0; i < n; i++) {
+			ch = h->block[h->block_pos + i];
+			if (svf_chclass[ch] == SVF_CH_LOWER)
+				ch -= 'a' - 'A';
+			else if (svf_chclass[ch] != SVF_CH_PLAIN)
+				break;
+			buffer[p++] = ch;
 		}
+		h->block_pos += i;
 	}
+
+complete:
+	buffer[p] = 0;
+	st->command_len = 0;
+	st->braket_mode = 0;
 	return 1;
+
+need_input:
+	st->command_len = p;
+	st->braket_mode = braket_mode;
+	return 2;
 }
 
 static int strtokencmp(const char *str1, const char *str2)
@@ -134,17 +381,71 @@ static int token2tapstate(const char *str1)
 	return -1;
 }
 
-struct bitdata_s {
-	int len, alloced_len;
-	int alloced_bytes;
-	unsigned char *tdi_data;
-	unsigned char *tdi_mask;
-	unsigned char *tdo_data;
-	unsigned char *tdo_mask;
-	unsigned char *ret_mask;
-	int has_tdo_data;
+
+/* command keywords, dispatched on the first character instead of trying them all in turn */
+enum svf_cmd {
+	SVF_CMD_UNKNOWN = 0,
+	SVF_CMD_ENDDR,
+	SVF_CMD_ENDIR,
+	SVF_CMD_ENDLOOP,
+	SVF_CMD_FREQUENCY,
+	SVF_CMD_HDR,
+	SVF_CMD_HIR,
+	SVF_CMD_LOOP,
+	SVF_CMD_PIO,
+	SVF_CMD_RUNTEST,
+	SVF_CMD_SDR,
+	SVF_CMD_SIR,
+	SVF_CMD_STATE,
+	SVF_CMD_TDR,
+	SVF_CMD_TIR,
+	SVF_CMD_TRST
 };
 
+static int svf_keyword(const char *str1)
+{
+#define X(_t) if (!strtokencmp(str1, #_t)) return SVF_CMD_ ## _t;
+	switch (str1[0])
+	{
+	case 'E':
+		X(ENDDR)
+		X(ENDIR)
+		X(ENDLOOP)
+		break;
+	case 'F':
+		X(FREQUENCY)
+		break;
+	case 'H':
+		X(HDR)
+		X(HIR)
+		break;
+	case 'L':
+		X(LOOP)
+		break;
+	case 'P':
+		X(PIO)
+		if (!strtokencmp(str1, "PIOMAP"))
+			return SVF_CMD_PIO;
+		break;
+	case 'R':
+		X(RUNTEST)
+		break;
+	case 'S':
+		X(SDR)
+		X(SIR)
+		X(STATE)
+		break;
+	case 'T':
+		X(TDR)
+		X(TIR)
+		X(TRST)
+		break;
+	}
+#undef X
+	return SVF_CMD_UNKNOWN;
+}
+
+
 static void bitdata_free(struct libxsvf_host *h, struct bitdata_s *bd, int offset)
 {
 	LIBXSVF_HOST_REALLOC(bd->tdi_data, 0, offset+0);
@@ -160,91 +461,120 @@ static void bitdata_free(struct libxsvf_host *h, struct bitdata_s *bd, int offse
 	bd->ret_mask = (void*)0;
 }
 
-static int hex(char ch)
+/*
+ * Decode the hex digits at p right-aligned into d[0..bytes-1], two digits
+ * per output byte, starting at the last digit. Only the leading bytes not
+ * covered by digits are cleared. Excess leading digits are ignored.
+ * Returns a pointer to the first non-hex character.
+ */
+static const char *hex_decode(const char *p, unsigned char *d, int bytes)
+{
+	const char *q = p;
+	while (HEX_VALUE(*q) != 0xff)
+		q++;
+
+	const char *end = q;
+	while (bytes > 0 && q - p >= 2) {
+		q -= 2;
+		d[--bytes] = (hex_table[q[0] - '0'] << 4) | hex_table[q[1] - '0'];
+	}
+	if (bytes > 0 && q > p)
+		d[--bytes] = hex_table[*--q - '0'];
+	while (bytes > 0)
+		d[--bytes] = 0;
+
+	return end;
+}
+
+static void bitdata_resize(struct libxsvf_host *h, struct bitdata_s *bd, int len, int offset)
+{
+	bd->len = len;
+	if (bd->len != bd->alloced_len) {
+		bitdata_free(h, bd, offset);
+		bd->alloced_len = bd->len;
+		bd->alloced_bytes = (bd->len+7) / 8;
+	}
+}
+
+/* returns the array a TDI/TDO/SMASK/MASK/RMASK token refers to, memnum follows the LIBXSVF_MEM_SVF_*_TDI_DATA.. order */
+static unsigned char **bitdata_field(const char *p, struct bitdata_s *bd, int *memnum)
+{
+	if (!strtokencmp(p, "TDI")) {
+		*memnum = 0;
+		return &bd->tdi_data;
+	}
+	if (!strtokencmp(p, "TDO")) {
+		*memnum = 2;
+		return &bd->tdo_data;
+	}
+	if (!strtokencmp(p, "SMASK")) {
+		*memnum = 1;
+		return &bd->tdi_mask;
+	}
+	if (!strtokencmp(p, "MASK")) {
+		*memnum = 3;
+		return &bd->tdo_mask;
+	}
+	if (!strtokencmp(p, "RMASK")) {
+		*memnum = 4;
+		return &bd->ret_mask;
+	}
+	return (void*)0;
+}
+
+/* the LIBXSVF_SHIFT_SAME_* bit of each field, by memnum */
+static const int bitdata_same[5] = {
+	LIBXSVF_SHIFT_SAME_TDI_DATA,
+	LIBXSVF_SHIFT_SAME_TDI_MASK,
+	LIBXSVF_SHIFT_SAME_TDO_DATA,
+	LIBXSVF_SHIFT_SAME_TDO_MASK,
+	LIBXSVF_SHIFT_SAME_RET_MASK
+};
+
+static int bitdata_alloc(struct libxsvf_host *h, struct bitdata_s *bd, unsigned char **dp, int offset, int memnum)
 {
-	if (ch >= 'A' && ch <= 'Z')
-		return (ch - 'A') + 10;
-	if (ch >= '0' && ch <= '9')
-		return ch - '0';
+	if (*dp == (void*)0) {
+		*dp = LIBXSVF_HOST_REALLOC(*dp, bd->alloced_bytes, offset+memnum);
+		bd->changed |= bitdata_same[memnum];
+	}
+	if (*dp == (void*)0) {
+		LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+		return -1;
+	}
 	return 0;
 }
 
 static const char *bitdata_parse(struct libxsvf_host *h, const char *p, struct bitdata_s *bd, int offset)
 {
-	int i, j;
-	bd->len = 0;
+	int len = 0;
 	bd->has_tdo_data = 0;
 	while (*p >= '0' && *p <= '9') {
-		bd->len = bd->len * 10 + (*p - '0');
+		len = len * 10 + (*p - '0');
 		p++;
 	}
 	while (*p == ' ') {
 		p++;
 	}
-	if (bd->len != bd->alloced_len) {
-		bitdata_free(h, bd, offset);
-		bd->alloced_len = bd->len;
-		bd->alloced_bytes = (bd->len+7) / 8;
-	}
+	bitdata_resize(h, bd, len, offset);
 	while (*p)
 	{
-		int memnum = 0;
-		unsigned char **dp = (void*)0;
-		if (!strtokencmp(p, "TDI")) {
-			p += strtokenskip(p);
-			dp = &bd->tdi_data;
-			memnum = 0;
-		}
-		if (!strtokencmp(p, "TDO")) {
-			p += strtokenskip(p);
-			dp = &bd->tdo_data;
-			bd->has_tdo_data = 1;
-			memnum = 1;
-		}
-		if (!strtokencmp(p, "SMASK")) {
-			p += strtokenskip(p);
-			dp = &bd->tdi_mask;
-			memnum = 2;
-		}
-		if (!strtokencmp(p, "MASK")) {
-			p += strtokenskip(p);
-			dp = &bd->tdo_mask;
-			memnum = 3;
-		}
-		if (!strtokencmp(p, "RMASK")) {
-			p += strtokenskip(p);
-			dp = &bd->ret_mask;
-			memnum = 4;
-		}
+		int memnum;
+		unsigned char **dp = bitdata_field(p, bd, &memnum);
 		if (!dp)
 			return (void*)0;
-		if (*dp == (void*)0) {
-			*dp = LIBXSVF_HOST_REALLOC(*dp, bd->alloced_bytes, offset+memnum);
-		}
-		if (*dp == (void*)0) {
-			LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+		if (bitdata_alloc(h, bd, dp, offset, memnum) < 0)
 			return (void*)0;
-		}
-
-		unsigned char *d = *dp;
-		for (i=0; i<bd->alloced_bytes; i++)
-			d[i] = 0;
+		if (dp == &bd->tdo_data)
+			bd->has_tdo_data = 1;
+		p += strtokenskip(p);
 
 		if (*p != '(')
 			return (void*)0;
-		p++;
-
-		int hexdigits = 0;
-		for (i=0; (p[i] >= 'A' && p[i] <= 'F') || (p[i] >= '0' && p[i] <= '9'); i++)
-			hexdigits++;
-
-		i = bd->alloced_bytes*2 - hexdigits;
-		for (j=0; j<hexdigits; j++, i++, p++) {
-			if (i%2 == 0) {
-				d[i/2] |= hex(*p) << 4;
-			} else {
-				d[i/2] |= hex(*p);
-			}
+		if (p[1] == '*') {
+			p += 2;	/* already decoded by read_command() */
+		} else {
+			p = hex_decode(p+1, *dp, bd->alloced_bytes);
+			bd->changed |= bitdata_same[memnum];
 		}
 
 		if (*p != ')')
@@ -256,6 +586,7 @@ static const char *bitdata_parse(struct libxsvf_host *h, const char *p, struct b
 	}
 #if 0
 	/* Debugging Output, needs <stdio.h> */
+	int i;
 	printf("--- Parsed bitdata [%d] ---\n", bd->len);
 	if (bd->tdi_data) {
 		printf("TDI DATA:");
@@ -285,373 +616,737 @@ static const char *bitdata_parse(struct libxsvf_host *h, const char *p, struct b
 	return p;
 }
 
-static int getbit(unsigned char *data, int n)
+static int stream_start(struct libxsvf_host *h, struct svf_state *st, int p)
+{
+	const char *buffer = st->command_buffer;
+	struct bitdata_s *bd;
+	int offset, memnum, len = 0, i;
+
+	switch (svf_keyword(buffer))
+	{
+	case SVF_CMD_HDR:
+		bd = &st->bd_hdr;
+		offset = LIBXSVF_MEM_SVF_HDR_TDI_DATA;
+		break;
+	case SVF_CMD_HIR:
+		bd = &st->bd_hir;
+		offset = LIBXSVF_MEM_SVF_HIR_TDI_DATA;
+		break;
+	case SVF_CMD_SDR:
+		bd = &st->bd_sdr;
+		offset = LIBXSVF_MEM_SVF_SDR_TDI_DATA;
+		break;
+	case SVF_CMD_SIR:
+		bd = &st->bd_sir;
+		offset = LIBXSVF_MEM_SVF_SIR_TDI_DATA;
+		break;
+	case SVF_CMD_TDR:
+		bd = &st->bd_tdr;
+		offset = LIBXSVF_MEM_SVF_TDR_TDI_DATA;
+		break;
+	case SVF_CMD_TIR:
+		bd = &st->bd_tir;
+		offset = LIBXSVF_MEM_SVF_TIR_TDI_DATA;
+		break;
+	default:
+		return 0;
+	}
+
+	/* the buffer holds "<command> <length> ... <field> (" */
+	i = strtokenskip(buffer);
+	if (buffer[i] < '0' || buffer[i] > '9')
+		return 0;
+	while (buffer[i] >= '0' && buffer[i] <= '9')
+		len = len * 10 + (buffer[i++] - '0');
+
+	for (i = p-1; i > 0 && buffer[i-1] == ' '; i--) { }
+	for (; i > 0 && buffer[i-1] != ' '; i--) { }
+
+	unsigned char **dp = bitdata_field(buffer + i, bd, &memnum);
+	if (!dp)
+		return 0;
+
+	bitdata_resize(h, bd, len, offset);
+	if (bitdata_alloc(h, bd, dp, offset, memnum) < 0)
+		return -1;
+
+	st->stream_data = *dp;
+	st->stream_bytes = bd->alloced_bytes;
+	st->stream_first = st->stream_bytes*2 - (len+3)/4;
+	st->stream_digits = st->stream_first;
+	st->stream_nibble = 0;
+	st->stream_changed = 0;
+	st->stream_bd = bd;
+	st->stream_bit = bitdata_same[memnum];
+	return 1;
+}
+
+/* tells if the 'len' right-aligned bits in 'data' are all ones, NULL stands for an all-ones mask */
+static int bits_all_ones(const unsigned char *data, int len)
 {
-	return (data[n/8] & (1 << (7 - n%8))) ? 1 : 0;
+	int i;
+
+	if (!data)
+		return 1;
+	for (i=0; i<(len+7) / 8; i++) {
+		int v = data[i];
+		if (i == 0 && len % 8)
+			v |= 0xff << len % 8;
+		if ((v & 0xff) != 0xff)
+			return 0;
+	}
+	return 1;
 }
 
-static int bitdata_play(struct libxsvf_host *h, struct bitdata_s *bd, enum libxsvf_tap_state estate)
+static int bitdata_play(struct libxsvf_host *h, struct bitdata_s *bd, enum libxsvf_tap_state state,
+		enum libxsvf_tap_state estate, int skip_same)
 {
-	int left_padding = (8 - bd->len % 8) % 8;
-	int tdo_error = 0;
-	int tms = 0;
+	if (skip_same && !(bd->changed & (LIBXSVF_SHIFT_SAME_TDI_DATA | LIBXSVF_SHIFT_SAME_TDI_MASK)) &&
+			!bd->has_tdo_data && !bd->ret_mask && bits_all_ones(bd->tdi_mask, bd->len))
+		return 1;
+	if (libxsvf_op_tap(h, state) < 0)
+		return -1;
+
+	/* tell the host which arrays still hold what it has seen at the same address */
+	h->shift_same = ~bd->changed & (LIBXSVF_SHIFT_SAME_TDI_DATA | LIBXSVF_SHIFT_SAME_TDI_MASK |
+			LIBXSVF_SHIFT_SAME_TDO_DATA | LIBXSVF_SHIFT_SAME_TDO_MASK | LIBXSVF_SHIFT_SAME_RET_MASK);
+	int rc = libxsvf_op_shift(h, bd->len, bd->tdi_data, bd->tdi_mask, bd->has_tdo_data ? bd->tdo_data : (void*)0,
+			bd->tdo_mask, bd->ret_mask, estate);
+	h->shift_same = 0;
+	bd->changed = 0;
+	return rc;
+}
+
+/* ORs 'len' bits of the right-aligned array 'src' (or of 'fill' when it is NULL) into 'dst', 'pos' bits from its LSB end */
+static void bits_put(unsigned char *dst, int dst_bytes, int pos, const unsigned char *src, int fill, int len)
+{
+	int src_bytes = (len+7) / 8;
 	int i;
 
-	for (i=bd->len+left_padding-1; i >= left_padding; i--) {
-		if (i == left_padding && h->tap_state != estate) {
-			h->tap_state++;
-			tms = 1;
-		}
-		int tdi = -1;
-		if (bd->tdi_data) {
-			if (!bd->tdi_mask || getbit(bd->tdi_mask, i))
-				tdi = getbit(bd->tdi_data, i);
+	for (i=0; i<src_bytes; i++) {
+		int v = src ? src[src_bytes-1-i] : fill;
+		if (i == src_bytes-1 && len % 8)
+			v &= (1 << len % 8) - 1;
+		int bit = pos + 8*i;
+		int d = dst_bytes-1 - bit/8;
+		dst[d] |= v << (bit % 8);
+		if (bit % 8 && d > 0)
+			dst[d-1] |= v >> (8 - bit % 8);
+	}
+}
+
+/*
+ * Plays header, body and trailer (HDR/SDR/TDR or HIR/SIR/TIR) as one register,
+ * so the host gets a single shift with one final TMS=1 bit. The fused arrays
+ * are only rebuilt for fields that changed in one of the parts since the
+ * last scan with the same layout.
+ *
+ * With skip_same set nothing is played and 1 is returned when the scan
+ * would shift the same fully defined TDI bits as the last one, without
+ * checking or returning TDO.
+ */
+static int scan_play(struct libxsvf_host *h, struct bitdata_s *scan, int *layout, int offset,
+		struct bitdata_s *head, struct bitdata_s *body, struct bitdata_s *trail,
+		enum libxsvf_tap_state state, enum libxsvf_tap_state estate, int skip_same)
+{
+	struct bitdata_s *parts[3] = { head, body, trail };
+	unsigned char **fields[5] = { &scan->tdi_data, &scan->tdi_mask, &scan->tdo_data, &scan->tdo_mask, &scan->ret_mask };
+	const unsigned char *src[3][5];
+	int fill[3][5];
+	int i, j, k, pos, changed = 0, needed = 0;
+
+	if (head->len == 0 && trail->len == 0) {
+		if (layout[0] >= 0)
+			skip_same = 0;
+		layout[0] = -1;
+		return bitdata_play(h, body, state, estate, skip_same);
+	}
+
+	for (i=0; i<3; i++) {
+		struct bitdata_s *bd = parts[i];
+		int kinds = 0;
+
+		/* NULL with fill 0 is a missing field, NULL with fill 0xff is an all-ones mask */
+		src[i][0] = bd->tdi_data;
+		fill[i][0] = 0;
+		src[i][1] = bd->tdi_data ? bd->tdi_mask : (void*)0;
+		fill[i][1] = bd->tdi_data ? 0xff : 0;
+		src[i][2] = bd->has_tdo_data ? bd->tdo_data : (void*)0;
+		fill[i][2] = 0;
+		src[i][3] = bd->has_tdo_data ? bd->tdo_mask : (void*)0;
+		fill[i][3] = bd->has_tdo_data ? 0xff : 0;
+		src[i][4] = bd->ret_mask;
+		fill[i][4] = 0;
+
+		for (j=0; j<5; j++) {
+			int kind = src[i][j] ? 2 : fill[i][j] ? 1 : 0;
+			kinds |= kind << 2*j;
+			/* data fields are needed when present anywhere, masks unless they are all-ones everywhere */
+			if (j == 0 || j == 2 || j == 4 ? kind != 0 : kind != 1)
+				needed |= 1 << j;
 		}
-		int tdo = -1;
-		if (bd->tdo_data && bd->has_tdo_data && (!bd->tdo_mask || getbit(bd->tdo_mask, i)))
-			tdo = getbit(bd->tdo_data, i);
-		int rmask = bd->ret_mask && getbit(bd->ret_mask, i);
-		if (LIBXSVF_HOST_PULSE_TCK(tms, tdi, tdo, rmask, 0) < 0)
-			tdo_error = 1;
+		if (layout[2*i] != bd->len || layout[2*i+1] != kinds)
+			changed = ~0;
+		layout[2*i] = bd->len;
+		layout[2*i+1] = kinds;
+		changed |= bd->changed;
+		bd->changed = 0;
 	}
+	if (!(needed & 1))
+		needed &= ~2;
+	if (!(needed & 4))
+		needed &= ~8;
 
-	if (tms)
-		LIBXSVF_HOST_REPORT_TAPSTATE();
+	bitdata_resize(h, scan, head->len + body->len + trail->len, offset);
 
-	if (!tdo_error)
-		return 0;
+	for (j=0; j<5; j++) {
+		if (!(needed & (1 << j)))
+			continue;
+		if (*fields[j] && !(changed & bitdata_same[j]))
+			continue;
+		if (bitdata_alloc(h, scan, fields[j], offset, j) < 0)
+			return -1;
+		for (k=0; k<scan->alloced_bytes; k++)
+			(*fields[j])[k] = 0;
+		for (i=0, pos=0; i<3; pos += parts[i++]->len)
+			bits_put(*fields[j], scan->alloced_bytes, pos, src[i][j], fill[i][j], parts[i]->len);
+		scan->changed |= bitdata_same[j];
+	}
 
-	LIBXSVF_HOST_REPORT_ERROR("TDO mismatch.");
-	return -1;
+	if (skip_same && !(changed & (LIBXSVF_SHIFT_SAME_TDI_DATA | LIBXSVF_SHIFT_SAME_TDI_MASK)) &&
+			!(needed & (4|16)) && (!(needed & 2) || bits_all_ones(scan->tdi_mask, scan->len)))
+		return 1;
+	if (libxsvf_op_tap(h, state) < 0)
+		return -1;
+
+	h->shift_same = ~scan->changed & (LIBXSVF_SHIFT_SAME_TDI_DATA | LIBXSVF_SHIFT_SAME_TDI_MASK |
+			LIBXSVF_SHIFT_SAME_TDO_DATA | LIBXSVF_SHIFT_SAME_TDO_MASK | LIBXSVF_SHIFT_SAME_RET_MASK);
+	int rc = libxsvf_op_shift(h, scan->len,
+			needed & 1 ? scan->tdi_data : (void*)0,
+			needed & 2 ? scan->tdi_mask : (void*)0,
+			needed & 4 ? scan->tdo_data : (void*)0,
+			needed & 8 ? scan->tdo_mask : (void*)0,
+			needed & 16 ? scan->ret_mask : (void*)0, estate);
+	h->shift_same = 0;
+	scan->changed = 0;
+	return rc;
 }
 
-int libxsvf_svf(struct libxsvf_host *h)
+int libxsvf_svf_start(struct libxsvf_host *h)
 {
-	char *command_buffer = (void*)0;
-	int command_buffer_len = 0;
-	int rc, i;
-
-	struct bitdata_s bd_hdr = { 0, 0, 0, (void*)0, (void*)0, (void*)0, (void*)0, (void*)0 };
-	struct bitdata_s bd_hir = { 0, 0, 0, (void*)0, (void*)0, (void*)0, (void*)0, (void*)0 };
-	struct bitdata_s bd_tdr = { 0, 0, 0, (void*)0, (void*)0, (void*)0, (void*)0, (void*)0 };
-	struct bitdata_s bd_tir = { 0, 0, 0, (void*)0, (void*)0, (void*)0, (void*)0, (void*)0 };
-	struct bitdata_s bd_sdr = { 0, 0, 0, (void*)0, (void*)0, (void*)0, (void*)0, (void*)0 };
-	struct bitdata_s bd_sir = { 0, 0, 0, (void*)0, (void*)0, (void*)0, (void*)0, (void*)0 };
-
-	int state_endir = LIBXSVF_TAP_IDLE;
-	int state_enddr = LIBXSVF_TAP_IDLE;
-	int state_run = LIBXSVF_TAP_IDLE;
-	int state_endrun = LIBXSVF_TAP_IDLE;
+	struct bitdata_s bd_empty = { 0, 0, 0, (void*)0, (void*)0, (void*)0, (void*)0, (void*)0 };
+	struct svf_state *st = LIBXSVF_HOST_REALLOC((void*)0, sizeof(struct svf_state), LIBXSVF_MEM_SVF_STATE);
 
-	while (1)
-	{
-		rc = read_command(h, &command_buffer, &command_buffer_len);
+	if (!st) {
+		LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+		return -1;
+	}
+
+	st->command_buffer = (void*)0;
+	st->command_buffer_len = 0;
+	st->command_len = 0;
+	st->braket_mode = 0;
+	st->in_comment = 0;
+	st->line = 1;
+	st->command_line = 0;
+	st->command_offset = 0;
+	st->stream_data = (void*)0;
+
+	st->bd_hdr = bd_empty;
+	st->bd_hir = bd_empty;
+	st->bd_tdr = bd_empty;
+	st->bd_tir = bd_empty;
+	st->bd_sdr = bd_empty;
+	st->bd_sir = bd_empty;
+	st->bd_drscan = bd_empty;
+	st->bd_irscan = bd_empty;
+	st->drscan_layout[0] = -1;
+	st->irscan_layout[0] = -1;
+	st->ir_known = 0;
+
+	st->state_endir = LIBXSVF_TAP_IDLE;
+	st->state_enddr = LIBXSVF_TAP_IDLE;
+	st->state_run = LIBXSVF_TAP_IDLE;
+	st->state_endrun = LIBXSVF_TAP_IDLE;
 
-		if (rc <= 0)
+	libxsvf_program_init(&st->loop_prog);
+	st->loop_count = 0;
+	st->in_loop = 0;
+
+	h->run_data = st;
+	return 0;
+}
+
+/* true when the operations are executed right away, not compiled, analyzed or passed to put_op() */
+static int direct_play(struct libxsvf_host *h)
+{
+	return !h->program && !h->stats && !h->put_op && !h->resume;
+}
+
+/*
+ * RUNTEST in IDLE with h->poll set: wait in slices of poll->interval_usecs
+ * and stop waiting as soon as the status register reads ready. Afterwards
+ * the last SIR is shifted again, as the poll has replaced the instruction.
+ */
+static int runtest_poll(struct libxsvf_host *h, struct svf_state *st, long usecs, long tck_count)
+{
+	const struct libxsvf_poll *poll = h->poll;
+	struct bitdata_s *ir = st->irscan_layout[0] < 0 ? &st->bd_sir : &st->bd_irscan;
+	long waited = 0;
+	int polled = 0;
+
+	if (libxsvf_op_sync(h) < 0)
+		return -1;
+
+	while (1) {
+		long slice = usecs - waited;
+		if (poll->interval_usecs > 0 && slice > poll->interval_usecs)
+			slice = poll->interval_usecs;
+		if (libxsvf_op_udelay(h, slice, 0, tck_count) < 0)
+			return -1;
+		tck_count = 0;
+		waited += slice;
+		if (waited >= usecs)
+			break;
+		int rc = libxsvf_op_poll(h, poll, LIBXSVF_TAP_IDLE);
+		if (rc < 0)
+			return -1;
+		polled = 1;
+		if (rc)
 			break;
+	}
 
-		const char *p = command_buffer;
+	if (polled && ir->len > 0 && ir->tdi_data) {
+		if (libxsvf_op_tap(h, LIBXSVF_TAP_IRSHIFT) < 0)
+			return -1;
+		if (libxsvf_op_shift(h, ir->len, ir->tdi_data, (void*)0, (void*)0, (void*)0, (void*)0, LIBXSVF_TAP_IREXIT1) < 0)
+			return -1;
+		if (libxsvf_op_tap(h, LIBXSVF_TAP_IDLE) < 0)
+			return -1;
+	}
 
-		LIBXSVF_HOST_REPORT_STATUS(command_buffer);
+	return 0;
+}
 
-		if (!strtokencmp(p, "ENDIR")) {
-			p += strtokenskip(p);
-			state_endir = token2tapstate(p);
-			if (state_endir < 0)
-				goto syntax_error;
-			p += strtokenskip(p);
-			goto eol_check;
+static int svf_command(struct libxsvf_host *h, struct svf_state *st)
+{
+	const char *p = st->command_buffer;
+	int i;
+
+	switch (svf_keyword(p))
+	{
+	case SVF_CMD_ENDIR: {
+		p += strtokenskip(p);
+		st->state_endir = token2tapstate(p);
+		if (st->state_endir < 0)
+			goto syntax_error;
+		p += strtokenskip(p);
+		goto eol_check;
+	}
+
+	case SVF_CMD_ENDDR: {
+		p += strtokenskip(p);
+		st->state_enddr = token2tapstate(p);
+		if (st->state_endir < 0)
+			goto syntax_error;
+		p += strtokenskip(p);
+		goto eol_check;
+	}
+
+	case SVF_CMD_FREQUENCY: {
+		unsigned long number = 0;
+		int exp = 0;
+		p += strtokenskip(p);
+		if (*p < '0' || *p > '9')
+			goto syntax_error;
+		while (*p >= '0' && *p <= '9') {
+			number = number*10 + (*p - '0');
+			p++;
 		}
+		if(*p == 'E' || *p == 'e') {
+			p++;
+			while (*p >= '0' && *p <= '9') {
+				exp = exp*10 + (*p - '0');
+				p++;
+			}
+			for(i=0; i<exp; i++)
+				number *= 10;
+		}
+		while (*p == ' ') {
+			p++;
+		}
+		p += strtokenskip(p);
+		if (libxsvf_op_frequency(h, number) < 0)
+			goto error;
+		goto eol_check;
+	}
 
-		if (!strtokencmp(p, "ENDDR")) {
-			p += strtokenskip(p);
-			state_enddr = token2tapstate(p);
-			if (state_endir < 0)
-				goto syntax_error;
-			p += strtokenskip(p);
-			goto eol_check;
+	case SVF_CMD_HDR: {
+		p += strtokenskip(p);
+		p = bitdata_parse(h, p, &st->bd_hdr, LIBXSVF_MEM_SVF_HDR_TDI_DATA);
+		if (!p)
+			goto syntax_error;
+		goto eol_check;
+	}
+
+	case SVF_CMD_HIR: {
+		p += strtokenskip(p);
+		p = bitdata_parse(h, p, &st->bd_hir, LIBXSVF_MEM_SVF_HIR_TDI_DATA);
+		if (!p)
+			goto syntax_error;
+		goto eol_check;
+	}
+
+	case SVF_CMD_LOOP: {
+		p += strtokenskip(p);
+		if (st->in_loop) {
+			LIBXSVF_HOST_REPORT_ERROR("Nested SVF LOOP commands are not supported.");
+			goto error;
 		}
+		if (*p < '0' || *p > '9')
+			goto syntax_error;
+		st->loop_count = 0;
+		while (*p >= '0' && *p <= '9') {
+			st->loop_count = st->loop_count*10 + (*p - '0');
+			p++;
+		}
+		if (st->loop_count == 0)
+			goto syntax_error;
+		/* analyzing counts the body once, like the first try of an XSDR with retries */
+		if (h->program || h->put_op) {
+			LIBXSVF_HOST_REPORT_ERROR("SVF LOOP can only be played directly.");
+			goto error;
+		}
+		st->in_loop = 1;
+		st->ir_known = 0;
+		if (!h->stats)
+			h->program = &st->loop_prog;
+		goto eol_check;
+	}
 
-		if (!strtokencmp(p, "FREQUENCY")) {
-			unsigned long number = 0;
-			int exp = 0;
-			p += strtokenskip(p);
+	case SVF_CMD_ENDLOOP: {
+		p += strtokenskip(p);
+		if (!st->in_loop)
+			goto syntax_error;
+		st->in_loop = 0;
+		if (h->program == &st->loop_prog) {
+			h->program = (void*)0;
+			int rc = libxsvf_program_loop(h, &st->loop_prog, st->loop_count);
+			libxsvf_program_free(h, &st->loop_prog);
+			libxsvf_program_init(&st->loop_prog);
+			if (rc < 0)
+				goto error;
+		}
+		goto eol_check;
+	}
+
+	case SVF_CMD_PIO: {
+		goto unsupported_error;
+	}
+
+	case SVF_CMD_RUNTEST: {
+		p += strtokenskip(p);
+		int tck_count = -1;
+		int sck_count = -1;
+		int min_time = -1;
+		int max_time = -1;
+		while (*p) {
+			int got_maximum = 0;
+			if (!strtokencmp(p, "MAXIMUM")) {
+				p += strtokenskip(p);
+				got_maximum = 1;
+			}
+			int got_endstate = 0;
+			if (!strtokencmp(p, "ENDSTATE")) {
+				p += strtokenskip(p);
+				got_endstate = 1;
+			}
+			int tap_state = token2tapstate(p);
+			if (tap_state >= 0) {
+				p += strtokenskip(p);
+				if (got_endstate)
+					st->state_endrun = tap_state;
+				else
+					st->state_run = tap_state;
+				continue;
+			}
 			if (*p < '0' || *p > '9')
 				goto syntax_error;
+			int number = 0;
+			int exp = 0, expsign = 1;
+			int number_e6, exp_e6;
 			while (*p >= '0' && *p <= '9') {
 				number = number*10 + (*p - '0');
 				p++;
 			}
 			if(*p == 'E' || *p == 'e') {
 				p++;
-				while (*p >= '0' && *p <= '9') {
-					exp = exp*10 + (*p - '0');
+				if(*p == '-') {
+					expsign = -1;
 					p++;
 				}
-				for(i=0; i<exp; i++)
-					number *= 10;
-			}
-			while (*p == ' ') {
-				p++;
-			}
-			p += strtokenskip(p);
-			if (LIBXSVF_HOST_SET_FREQUENCY(number) < 0) {
-				LIBXSVF_HOST_REPORT_ERROR("FREQUENCY command failed!");
-				goto error;
-			}
-			goto eol_check;
-		}
-
-		if (!strtokencmp(p, "HDR")) {
-			p += strtokenskip(p);
-			p = bitdata_parse(h, p, &bd_hdr, LIBXSVF_MEM_SVF_HDR_TDI_DATA);
-			if (!p)
-				goto syntax_error;
-			goto eol_check;
-		}
-
-		if (!strtokencmp(p, "HIR")) {
-			p += strtokenskip(p);
-			p = bitdata_parse(h, p, &bd_hir, LIBXSVF_MEM_SVF_HIR_TDI_DATA);
-			if (!p)
-				goto syntax_error;
-			goto eol_check;
-		}
-
-		if (!strtokencmp(p, "PIO") || !strtokencmp(p, "PIOMAP")) {
-			goto unsupported_error;
-		}
-
-		if (!strtokencmp(p, "RUNTEST")) {
-			p += strtokenskip(p);
-			int tck_count = -1;
-			int sck_count = -1;
-			int min_time = -1;
-			int max_time = -1;
-			while (*p) {
-				int got_maximum = 0;
-				if (!strtokencmp(p, "MAXIMUM")) {
-					p += strtokenskip(p);
-					got_maximum = 1;
-				}
-				int got_endstate = 0;
-				if (!strtokencmp(p, "ENDSTATE")) {
-					p += strtokenskip(p);
-					got_endstate = 1;
-				}
-				int st = token2tapstate(p);
-				if (st >= 0) {
-					p += strtokenskip(p);
-					if (got_endstate)
-						state_endrun = st;
-					else
-						state_run = st;
-					continue;
-				}
-				if (*p < '0' || *p > '9')
-					goto syntax_error;
-				int number = 0;
-				int exp = 0, expsign = 1;
-				int number_e6, exp_e6;
 				while (*p >= '0' && *p <= '9') {
-					number = number*10 + (*p - '0');
+					exp = exp*10 + (*p - '0');
 					p++;
 				}
-				if(*p == 'E' || *p == 'e') {
-					p++;
-					if(*p == '-') {
-						expsign = -1;
-						p++;
-					}
-					while (*p >= '0' && *p <= '9') {
-						exp = exp*10 + (*p - '0');
-						p++;
-					}
-					exp = exp * expsign;
-					number_e6 = number;
-					exp_e6 = exp + 6;
-					while (exp < 0) {
-						number /= 10;
-						exp++;
-					}
-					while (exp > 0) {
-						number *= 10;
-						exp--;
-					}
-					while (exp_e6 < 0) {
-						number_e6 /= 10;
-						exp_e6++;
-					}
-					while (exp_e6 > 0) {
-						number_e6 *= 10;
-						exp_e6--;
-					}
-				} else {
-					number_e6 = number * 1000000;
+				exp = exp * expsign;
+				number_e6 = number;
+				exp_e6 = exp + 6;
+				while (exp < 0) {
+					number /= 10;
+					exp++;
 				}
-				while (*p == ' ') {
-					p++;
-				}
-				if (!strtokencmp(p, "SEC")) {
-					p += strtokenskip(p);
-					if (got_maximum)
-						max_time = number_e6;
-					else
-						min_time = number_e6;
-					continue;
+				while (exp > 0) {
+					number *= 10;
+					exp--;
 				}
-				if (!strtokencmp(p, "TCK")) {
-					p += strtokenskip(p);
-					tck_count = number;
-					continue;
+				while (exp_e6 < 0) {
+					number_e6 /= 10;
+					exp_e6++;
 				}
-				if (!strtokencmp(p, "SCK")) {
-					p += strtokenskip(p);
-					sck_count = number;
-					continue;
+				while (exp_e6 > 0) {
+					number_e6 *= 10;
+					exp_e6--;
 				}
-				goto syntax_error;
+			} else {
+				number_e6 = number * 1000000;
 			}
-			if (libxsvf_tap_walk(h, state_run) < 0)
-				goto error;
-			if (max_time >= 0) {
-				LIBXSVF_HOST_REPORT_ERROR("WARNING: Maximum time in SVF RUNTEST command is ignored.");
+			while (*p == ' ') {
+				p++;
 			}
-			if (sck_count >= 0) {
-				for (i=0; i < sck_count; i++) {
-					LIBXSVF_HOST_PULSE_SCK();
-				}
+			if (!strtokencmp(p, "SEC")) {
+				p += strtokenskip(p);
+				if (got_maximum)
+					max_time = number_e6;
+				else
+					min_time = number_e6;
+				continue;
 			}
-			if (min_time >= 0 || tck_count >= 0) {
-				LIBXSVF_HOST_UDELAY(min_time >= 0 ? min_time : 0, 0, tck_count >= 0 ? tck_count : 0);
+			if (!strtokencmp(p, "TCK")) {
+				p += strtokenskip(p);
+				tck_count = number;
+				continue;
 			}
-			if (libxsvf_tap_walk(h, state_endrun) < 0)
-				goto error;
-			goto eol_check;
+			if (!strtokencmp(p, "SCK")) {
+				p += strtokenskip(p);
+				sck_count = number;
+				continue;
+			}
+			goto syntax_error;
 		}
-
-		if (!strtokencmp(p, "SDR")) {
-			p += strtokenskip(p);
-			p = bitdata_parse(h, p, &bd_sdr, LIBXSVF_MEM_SVF_SDR_TDI_DATA);
-			if (!p)
-				goto syntax_error;
-			if (libxsvf_tap_walk(h, LIBXSVF_TAP_DRSHIFT) < 0)
-				goto error;
-			if (bitdata_play(h, &bd_hdr, bd_sdr.len+bd_tdr.len > 0 ? LIBXSVF_TAP_DRSHIFT : state_enddr) < 0)
-				goto error;
-			if (bitdata_play(h, &bd_sdr, bd_tdr.len > 0 ? LIBXSVF_TAP_DRSHIFT : state_enddr) < 0)
+		if (libxsvf_op_tap(h, st->state_run) < 0)
+			goto error;
+		if (max_time >= 0) {
+			LIBXSVF_HOST_REPORT_ERROR("WARNING: Maximum time in SVF RUNTEST command is ignored.");
+		}
+		if (sck_count >= 0) {
+			if (libxsvf_op_sck(h, sck_count) < 0)
 				goto error;
-			if (bitdata_play(h, &bd_tdr, state_enddr) < 0)
+		}
+		if (h->poll && direct_play(h) && st->state_run == LIBXSVF_TAP_IDLE && min_time >= h->poll->min_usecs) {
+			if (runtest_poll(h, st, min_time, tck_count >= 0 ? tck_count : 0) < 0)
 				goto error;
-			if (libxsvf_tap_walk(h, state_enddr) < 0)
+		} else if (min_time >= 0 || tck_count >= 0) {
+			if (libxsvf_op_udelay(h, min_time >= 0 ? min_time : 0, 0, tck_count >= 0 ? tck_count : 0) < 0)
 				goto error;
-			goto eol_check;
 		}
+		if (libxsvf_op_tap(h, st->state_endrun) < 0)
+			goto error;
+		if (!libxsvf_tap_keeps_ir(st->state_run) || !libxsvf_tap_keeps_ir(st->state_endrun))
+			st->ir_known = 0;
+		goto eol_check;
+	}
 
-		if (!strtokencmp(p, "SIR")) {
-			p += strtokenskip(p);
-			p = bitdata_parse(h, p, &bd_sir, LIBXSVF_MEM_SVF_SIR_TDI_DATA);
-			if (!p)
+	case SVF_CMD_SDR: {
+		p += strtokenskip(p);
+		p = bitdata_parse(h, p, &st->bd_sdr, LIBXSVF_MEM_SVF_SDR_TDI_DATA);
+		if (!p)
+			goto syntax_error;
+		if (scan_play(h, &st->bd_drscan, st->drscan_layout, LIBXSVF_MEM_SVF_DRSCAN_TDI_DATA,
+				&st->bd_hdr, &st->bd_sdr, &st->bd_tdr, LIBXSVF_TAP_DRSHIFT, st->state_enddr, 0) < 0)
+			goto error;
+		if (libxsvf_op_tap(h, st->state_enddr) < 0)
+			goto error;
+		if (!libxsvf_tap_keeps_ir(st->state_enddr))
+			st->ir_known = 0;
+		goto eol_check;
+	}
+
+	case SVF_CMD_SIR: {
+		int rc = st->in_loop ? 0 : libxsvf_checkpoint(h);
+		if (rc < 0)
+			goto error;
+		/* resuming here, the IR content is unknown */
+		if (rc > 0)
+			st->ir_known = 0;
+		p += strtokenskip(p);
+		p = bitdata_parse(h, p, &st->bd_sir, LIBXSVF_MEM_SVF_SIR_TDI_DATA);
+		if (!p)
+			goto syntax_error;
+		/* the IR still holds the last SIR when it was updated and no walk has passed IRCAPTURE or RESET since */
+		int skip_same = (h->flags & LIBXSVF_FLAG_SKIP_SAME_IR) && st->ir_known && !st->in_loop &&
+				libxsvf_tap_keeps_ir(st->state_endir);
+		rc = scan_play(h, &st->bd_irscan, st->irscan_layout, LIBXSVF_MEM_SVF_IRSCAN_TDI_DATA,
+				&st->bd_hir, &st->bd_sir, &st->bd_tir, LIBXSVF_TAP_IRSHIFT, st->state_endir, skip_same);
+		if (rc < 0)
+			goto error;
+		if (rc > 0)
+			h->skipped_ir_bits += st->bd_hir.len + st->bd_sir.len + st->bd_tir.len;
+		if (libxsvf_op_tap(h, st->state_endir) < 0)
+			goto error;
+		st->ir_known = !st->in_loop && libxsvf_tap_keeps_ir(st->state_endir);
+		goto eol_check;
+	}
+
+	case SVF_CMD_STATE: {
+		p += strtokenskip(p);
+		while (*p) {
+			int tap_state = token2tapstate(p);
+			if (tap_state < 0)
 				goto syntax_error;
-			if (libxsvf_tap_walk(h, LIBXSVF_TAP_IRSHIFT) < 0)
-				goto error;
-			if (bitdata_play(h, &bd_hir, bd_sir.len+bd_tir.len > 0 ? LIBXSVF_TAP_IRSHIFT : state_endir) < 0)
+			if (libxsvf_op_tap(h, tap_state) < 0)
 				goto error;
-			if (bitdata_play(h, &bd_sir, bd_tir.len > 0 ? LIBXSVF_TAP_IRSHIFT : state_endir) < 0)
-				goto error;
-			if (bitdata_play(h, &bd_tir, state_endir) < 0)
-				goto error;
-			if (libxsvf_tap_walk(h, state_endir) < 0)
-				goto error;
-			goto eol_check;
+			if (!libxsvf_tap_keeps_ir(tap_state))
+				st->ir_known = 0;
+			p += strtokenskip(p);
 		}
+		goto eol_check;
+	}
 
-		if (!strtokencmp(p, "STATE")) {
+	case SVF_CMD_TDR: {
+		p += strtokenskip(p);
+		p = bitdata_parse(h, p, &st->bd_tdr, LIBXSVF_MEM_SVF_TDR_TDI_DATA);
+		if (!p)
+			goto syntax_error;
+		goto eol_check;
+	}
+
+	case SVF_CMD_TIR: {
+		p += strtokenskip(p);
+		p = bitdata_parse(h, p, &st->bd_tir, LIBXSVF_MEM_SVF_TIR_TDI_DATA);
+		if (!p)
+			goto syntax_error;
+		goto eol_check;
+	}
+
+	case SVF_CMD_TRST: {
+		p += strtokenskip(p);
+		st->ir_known = 0;
+		if (!strtokencmp(p, "ON")) {
 			p += strtokenskip(p);
-			while (*p) {
-				int st = token2tapstate(p);
-				if (st < 0)
-					goto syntax_error;
-				if (libxsvf_tap_walk(h, st) < 0)
-					goto error;
-				p += strtokenskip(p);
-			}
+			if (libxsvf_op_trst(h, 1) < 0)
+				goto error;
 			goto eol_check;
 		}
-
-		if (!strtokencmp(p, "TDR")) {
+		if (!strtokencmp(p, "OFF")) {
 			p += strtokenskip(p);
-			p = bitdata_parse(h, p, &bd_tdr, LIBXSVF_MEM_SVF_TDR_TDI_DATA);
-			if (!p)
-				goto syntax_error;
+			if (libxsvf_op_trst(h, 0) < 0)
+				goto error;
 			goto eol_check;
 		}
-
-		if (!strtokencmp(p, "TIR")) {
+		if (!strtokencmp(p, "Z")) {
 			p += strtokenskip(p);
-			p = bitdata_parse(h, p, &bd_tir, LIBXSVF_MEM_SVF_TIR_TDI_DATA);
-			if (!p)
-				goto syntax_error;
+			if (libxsvf_op_trst(h, -1) < 0)
+				goto error;
 			goto eol_check;
 		}
-
-		if (!strtokencmp(p, "TRST")) {
+		if (!strtokencmp(p, "ABSENT")) {
 			p += strtokenskip(p);
-			if (!strtokencmp(p, "ON")) {
-				p += strtokenskip(p);
-				LIBXSVF_HOST_SET_TRST(1);
-				goto eol_check;
-			}
-			if (!strtokencmp(p, "OFF")) {
-				p += strtokenskip(p);
-				LIBXSVF_HOST_SET_TRST(0);
-				goto eol_check;
-			}
-			if (!strtokencmp(p, "Z")) {
-				p += strtokenskip(p);
-				LIBXSVF_HOST_SET_TRST(-1);
-				goto eol_check;
-			}
-			if (!strtokencmp(p, "ABSENT")) {
-				p += strtokenskip(p);
-				LIBXSVF_HOST_SET_TRST(-2);
-				goto eol_check;
-			}
-			goto syntax_error;
+			if (libxsvf_op_trst(h, -2) < 0)
+				goto error;
+			goto eol_check;
 		}
+		goto syntax_error;
+	}
+	}
 
 eol_check:
-		while (*p == ' ')
-			p++;
-		if (*p == 0)
-			continue;
+	while (*p == ' ')
+		p++;
+	if (*p == 0)
+		return 0;
 
 syntax_error:
-		LIBXSVF_HOST_REPORT_ERROR("SVF Syntax Error:");
-		if (0) {
+	LIBXSVF_HOST_REPORT_ERROR("SVF Syntax Error:");
+	if (0) {
 unsupported_error:
-			LIBXSVF_HOST_REPORT_ERROR("Error in SVF input: unsupported command:");
-		}
-		LIBXSVF_HOST_REPORT_ERROR(command_buffer);
+		LIBXSVF_HOST_REPORT_ERROR("Error in SVF input: unsupported command:");
+	}
+	LIBXSVF_HOST_REPORT_ERROR(st->command_buffer);
 error:
-		rc = -1;
-		break;
+	return -1;
+}
+
+int libxsvf_svf_step(struct libxsvf_host *h)
+{
+	struct svf_state *st = h->run_data;
+	int rc = read_command(h, st);
+
+	if (rc == 2)
+		return LIBXSVF_STEP_NEED_INPUT;
+	if (rc < 0)
+		return LIBXSVF_STEP_ERROR;
+	if (rc == 0)
+		return LIBXSVF_STEP_DONE;
+
+	h->location.command++;
+	h->location.line = st->command_line;
+	h->location.offset = st->command_offset;
+
+	LIBXSVF_HOST_REPORT_STATUS(st->command_buffer);
+
+	if (svf_command(h, st) < 0)
+		return LIBXSVF_STEP_ERROR;
+
+	return LIBXSVF_STEP_CONTINUE;
+}
+
+int libxsvf_svf_finish(struct libxsvf_host *h, int rc)
+{
+	struct svf_state *st = h->run_data;
+
+	if (!st)
+		return rc;
+
+	if (st->in_loop) {
+		if (h->program == &st->loop_prog)
+			h->program = (void*)0;
+		if (rc >= 0) {
+			LIBXSVF_HOST_REPORT_ERROR("SVF LOOP without ENDLOOP.");
+			rc = -1;
+		}
 	}
+	libxsvf_program_free(h, &st->loop_prog);
 
-	if (LIBXSVF_HOST_SYNC() != 0 && rc >= 0 ) {
-		LIBXSVF_HOST_REPORT_ERROR("TDO mismatch.");
+	if (rc >= 0 && libxsvf_op_sync(h) < 0)
 		rc = -1;
-	}
 
-	bitdata_free(h, &bd_hdr, LIBXSVF_MEM_SVF_HDR_TDI_DATA);
-	bitdata_free(h, &bd_hir, LIBXSVF_MEM_SVF_HIR_TDI_DATA);
-	bitdata_free(h, &bd_tdr, LIBXSVF_MEM_SVF_TDR_TDI_DATA);
-	bitdata_free(h, &bd_tir, LIBXSVF_MEM_SVF_TIR_TDI_DATA);
-	bitdata_free(h, &bd_sdr, LIBXSVF_MEM_SVF_SDR_TDI_DATA);
-	bitdata_free(h, &bd_sir, LIBXSVF_MEM_SVF_SIR_TDI_DATA);
+	bitdata_free(h, &st->bd_hdr, LIBXSVF_MEM_SVF_HDR_TDI_DATA);
+	bitdata_free(h, &st->bd_hir, LIBXSVF_MEM_SVF_HIR_TDI_DATA);
+	bitdata_free(h, &st->bd_tdr, LIBXSVF_MEM_SVF_TDR_TDI_DATA);
+	bitdata_free(h, &st->bd_tir, LIBXSVF_MEM_SVF_TIR_TDI_DATA);
+	bitdata_free(h, &st->bd_sdr, LIBXSVF_MEM_SVF_SDR_TDI_DATA);
+	bitdata_free(h, &st->bd_sir, LIBXSVF_MEM_SVF_SIR_TDI_DATA);
+	bitdata_free(h, &st->bd_drscan, LIBXSVF_MEM_SVF_DRSCAN_TDI_DATA);
+	bitdata_free(h, &st->bd_irscan, LIBXSVF_MEM_SVF_IRSCAN_TDI_DATA);
 
-	LIBXSVF_HOST_REALLOC(command_buffer, 0, LIBXSVF_MEM_SVF_COMMANDBUF);
+	LIBXSVF_HOST_REALLOC(st->command_buffer, 0, LIBXSVF_MEM_SVF_COMMANDBUF);
+	LIBXSVF_HOST_REALLOC(st, 0, LIBXSVF_MEM_SVF_STATE);
+	h->run_data = (void*)0;
 
 	return rc;
 }
 
+int libxsvf_svf(struct libxsvf_host *h)
+{
+	int rc;
+
+	if (libxsvf_svf_start(h) < 0)
+		return -1;
+
+	do {
+		rc = libxsvf_svf_step(h);
+	} while (rc > 0);
+
+	return libxsvf_svf_finish(h, rc);
+}
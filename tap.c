@@ -25,149 +25,182 @@ static void tap_transition(struct libxsvf_host *h, int v)
 	LIBXSVF_HOST_PULSE_TCK(v, -1, -1, 0, 0);
 }
 
+/* TMS sequences (first bit in the LSB) for walking from one TAP state to
+ * another. The paths between the stable states are the default state paths
+ * from the SVF specification. */
+static const struct {
+	unsigned short tms;
+	unsigned char len;
+} tap_path[17][17] = {
+	/* from INIT */
+	{ { 0x0000,  0 }, { 0x003f,  6 }, { 0x003f,  7 }, { 0x00bf,  8 }, { 0x00bf,  9 }, { 0x00bf, 10 }, { 0x02bf, 10 }, { 0x02bf, 11 }, { 0x0abf, 12 },
+	  { 0x06bf, 11 }, { 0x01bf,  9 }, { 0x01bf, 10 }, { 0x01bf, 11 }, { 0x05bf, 11 }, { 0x05bf, 12 }, { 0x15bf, 13 }, { 0x0dbf, 12 } },
+	/* from RESET */
+	{ { 0x0000,  0 }, { 0x0000,  0 }, { 0x0000,  1 }, { 0x0002,  2 }, { 0x0002,  3 }, { 0x0002,  4 }, { 0x000a,  4 }, { 0x000a,  5 }, { 0x002a,  6 },
+	  { 0x001a,  5 }, { 0x0006,  3 }, { 0x0006,  4 }, { 0x0006,  5 }, { 0x0016,  5 }, { 0x0016,  6 }, { 0x0056,  7 }, { 0x0036,  6 } },
+	/* from IDLE */
+	{ { 0x0000,  0 }, { 0x0007,  3 }, { 0x0000,  0 }, { 0x0001,  1 }, { 0x0001,  2 }, { 0x0001,  3 }, { 0x0005,  3 }, { 0x0005,  4 }, { 0x0015,  5 },
+	  { 0x000d,  4 }, { 0x0003,  2 }, { 0x0003,  3 }, { 0x0003,  4 }, { 0x000b,  4 }, { 0x000b,  5 }, { 0x002b,  6 }, { 0x001b,  5 } },
+	/* from DRSELECT */
+	{ { 0x0000,  0 }, { 0x0003,  2 }, { 0x0006,  4 }, { 0x0000,  0 }, { 0x0000,  1 }, { 0x0000,  2 }, { 0x0002,  2 }, { 0x0002,  3 }, { 0x000a,  4 },
+	  { 0x0006,  3 }, { 0x0001,  1 }, { 0x0001,  2 }, { 0x0001,  3 }, { 0x0005,  3 }, { 0x0005,  4 }, { 0x0015,  5 }, { 0x000d,  4 } },
+	/* from DRCAPTURE */
+	{ { 0x0000,  0 }, { 0x001f,  5 }, { 0x0003,  3 }, { 0x0007,  3 }, { 0x0000,  0 }, { 0x0000,  1 }, { 0x0001,  1 }, { 0x0001,  2 }, { 0x0005,  3 },
+	  { 0x0003,  2 }, { 0x000f,  4 }, { 0x000f,  5 }, { 0x000f,  6 }, { 0x002f,  6 }, { 0x002f,  7 }, { 0x00af,  8 }, { 0x006f,  7 } },
+	/* from DRSHIFT */
+	{ { 0x0000,  0 }, { 0x001f,  5 }, { 0x0003,  3 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0000,  0 }, { 0x0001,  1 }, { 0x0001,  2 }, { 0x0005,  3 },
+	  { 0x0003,  2 }, { 0x000f,  4 }, { 0x000f,  5 }, { 0x000f,  6 }, { 0x002f,  6 }, { 0x002f,  7 }, { 0x00af,  8 }, { 0x006f,  7 } },
+	/* from DREXIT1 */
+	{ { 0x0000,  0 }, { 0x000f,  4 }, { 0x0001,  2 }, { 0x0003,  2 }, { 0x0003,  3 }, { 0x0003,  4 }, { 0x0000,  0 }, { 0x0000,  1 }, { 0x0002,  2 },
+	  { 0x0001,  1 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0007,  5 }, { 0x0017,  5 }, { 0x0017,  6 }, { 0x0057,  7 }, { 0x0037,  6 } },
+	/* from DRPAUSE */
+	{ { 0x0000,  0 }, { 0x001f,  5 }, { 0x0003,  3 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0001,  2 }, { 0x0017,  5 }, { 0x0000,  0 }, { 0x0001,  1 },
+	  { 0x0003,  2 }, { 0x000f,  4 }, { 0x000f,  5 }, { 0x000f,  6 }, { 0x002f,  6 }, { 0x002f,  7 }, { 0x00af,  8 }, { 0x006f,  7 } },
+	/* from DREXIT2 */
+	{ { 0x0000,  0 }, { 0x000f,  4 }, { 0x0001,  2 }, { 0x0003,  2 }, { 0x0003,  3 }, { 0x0000,  1 }, { 0x000b,  4 }, { 0x000b,  5 }, { 0x0000,  0 },
+	  { 0x0001,  1 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0007,  5 }, { 0x0017,  5 }, { 0x0017,  6 }, { 0x0057,  7 }, { 0x0037,  6 } },
+	/* from DRUPDATE */
+	{ { 0x0000,  0 }, { 0x0007,  3 }, { 0x0000,  1 }, { 0x0001,  1 }, { 0x0001,  2 }, { 0x0001,  3 }, { 0x0005,  3 }, { 0x0005,  4 }, { 0x0015,  5 },
+	  { 0x0000,  0 }, { 0x0003,  2 }, { 0x0003,  3 }, { 0x0003,  4 }, { 0x000b,  4 }, { 0x000b,  5 }, { 0x002b,  6 }, { 0x001b,  5 } },
+	/* from IRSELECT */
+	{ { 0x0000,  0 }, { 0x0001,  1 }, { 0x0006,  4 }, { 0x000e,  4 }, { 0x000e,  5 }, { 0x000e,  6 }, { 0x002e,  6 }, { 0x002e,  7 }, { 0x0055,  7 },
+	  { 0x006e,  7 }, { 0x0000,  0 }, { 0x0000,  1 }, { 0x0000,  2 }, { 0x0002,  2 }, { 0x0002,  3 }, { 0x000a,  4 }, { 0x0006,  3 } },
+	/* from IRCAPTURE */
+	{ { 0x0000,  0 }, { 0x001f,  5 }, { 0x0003,  3 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0007,  5 }, { 0x0017,  5 }, { 0x0017,  6 }, { 0x0057,  7 },
+	  { 0x0037,  6 }, { 0x000f,  4 }, { 0x0000,  0 }, { 0x0000,  1 }, { 0x0001,  1 }, { 0x0001,  2 }, { 0x0005,  3 }, { 0x0003,  2 } },
+	/* from IRSHIFT */
+	{ { 0x0000,  0 }, { 0x001f,  5 }, { 0x0003,  3 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0007,  5 }, { 0x0017,  5 }, { 0x0017,  6 }, { 0x0057,  7 },
+	  { 0x0037,  6 }, { 0x000f,  4 }, { 0x000f,  5 }, { 0x0000,  0 }, { 0x0001,  1 }, { 0x0001,  2 }, { 0x0005,  3 }, { 0x0003,  2 } },
+	/* from IREXIT1 */
+	{ { 0x0000,  0 }, { 0x000f,  4 }, { 0x0001,  2 }, { 0x0003,  2 }, { 0x0003,  3 }, { 0x0003,  4 }, { 0x000b,  4 }, { 0x000b,  5 }, { 0x002b,  6 },
+	  { 0x001b,  5 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0007,  5 }, { 0x0000,  0 }, { 0x0000,  1 }, { 0x0002,  2 }, { 0x0001,  1 } },
+	/* from IRPAUSE */
+	{ { 0x0000,  0 }, { 0x001f,  5 }, { 0x0003,  3 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0007,  5 }, { 0x0017,  5 }, { 0x0017,  6 }, { 0x0057,  7 },
+	  { 0x0037,  6 }, { 0x000f,  4 }, { 0x000f,  5 }, { 0x0001,  2 }, { 0x002f,  6 }, { 0x0000,  0 }, { 0x0001,  1 }, { 0x0003,  2 } },
+	/* from IREXIT2 */
+	{ { 0x0000,  0 }, { 0x000f,  4 }, { 0x0001,  2 }, { 0x0003,  2 }, { 0x0003,  3 }, { 0x0003,  4 }, { 0x000b,  4 }, { 0x000b,  5 }, { 0x002b,  6 },
+	  { 0x001b,  5 }, { 0x0007,  3 }, { 0x0007,  4 }, { 0x0000,  1 }, { 0x0017,  5 }, { 0x0017,  6 }, { 0x0000,  0 }, { 0x0001,  1 } },
+	/* from IRUPDATE */
+	{ { 0x0000,  0 }, { 0x0007,  3 }, { 0x0000,  1 }, { 0x0001,  1 }, { 0x0001,  2 }, { 0x0001,  3 }, { 0x0005,  3 }, { 0x0005,  4 }, { 0x0015,  5 },
+	  { 0x000d,  4 }, { 0x0003,  2 }, { 0x0003,  3 }, { 0x0003,  4 }, { 0x000b,  4 }, { 0x000b,  5 }, { 0x002b,  6 }, { 0x0000,  0 } },
+};
+
+static const unsigned char tap_next[17][2] = {
+	/* INIT */      { LIBXSVF_TAP_INIT,      LIBXSVF_TAP_RESET },
+	/* RESET */     { LIBXSVF_TAP_IDLE,      LIBXSVF_TAP_RESET },
+	/* IDLE */      { LIBXSVF_TAP_IDLE,      LIBXSVF_TAP_DRSELECT },
+	/* DRSELECT */  { LIBXSVF_TAP_DRCAPTURE, LIBXSVF_TAP_IRSELECT },
+	/* DRCAPTURE */ { LIBXSVF_TAP_DRSHIFT,   LIBXSVF_TAP_DREXIT1 },
+	/* DRSHIFT */   { LIBXSVF_TAP_DRSHIFT,   LIBXSVF_TAP_DREXIT1 },
+	/* DREXIT1 */   { LIBXSVF_TAP_DRPAUSE,   LIBXSVF_TAP_DRUPDATE },
+	/* DRPAUSE */   { LIBXSVF_TAP_DRPAUSE,   LIBXSVF_TAP_DREXIT2 },
+	/* DREXIT2 */   { LIBXSVF_TAP_DRSHIFT,   LIBXSVF_TAP_DRUPDATE },
+	/* DRUPDATE */  { LIBXSVF_TAP_IDLE,      LIBXSVF_TAP_DRSELECT },
+	/* IRSELECT */  { LIBXSVF_TAP_IRCAPTURE, LIBXSVF_TAP_RESET },
+	/* IRCAPTURE */ { LIBXSVF_TAP_IRSHIFT,   LIBXSVF_TAP_IREXIT1 },
+	/* IRSHIFT */   { LIBXSVF_TAP_IRSHIFT,   LIBXSVF_TAP_IREXIT1 },
+	/* IREXIT1 */   { LIBXSVF_TAP_IRPAUSE,   LIBXSVF_TAP_IRUPDATE },
+	/* IRPAUSE */   { LIBXSVF_TAP_IRPAUSE,   LIBXSVF_TAP_IREXIT2 },
+	/* IREXIT2 */   { LIBXSVF_TAP_IRSHIFT,   LIBXSVF_TAP_IRUPDATE },
+	/* IRUPDATE */  { LIBXSVF_TAP_IDLE,      LIBXSVF_TAP_DRSELECT }
+};
+
 int libxsvf_tap_walk(struct libxsvf_host *h, enum libxsvf_tap_state s)
 {
-	int i, j;
-	for (i=0; s != h->tap_state; i++)
-	{
-		switch (h->tap_state)
-		{
-		/* Special States */
-		case LIBXSVF_TAP_INIT:
-			for (j = 0; j < 6; j++)
-				tap_transition(h, 1);
-			h->tap_state = LIBXSVF_TAP_RESET;
-			break;
-		case LIBXSVF_TAP_RESET:
-			tap_transition(h, 0);
-			h->tap_state = LIBXSVF_TAP_IDLE;
-			break;
-		case LIBXSVF_TAP_IDLE:
-			tap_transition(h, 1);
-			h->tap_state = LIBXSVF_TAP_DRSELECT;
-			break;
-
-		/* DR States */
-		case LIBXSVF_TAP_DRSELECT:
-			if (s >= LIBXSVF_TAP_IRSELECT || s == LIBXSVF_TAP_RESET) {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_IRSELECT;
-			} else {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_DRCAPTURE;
-			}
-			break;
-		case LIBXSVF_TAP_DRCAPTURE:
-			if (s == LIBXSVF_TAP_DRSHIFT) {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_DRSHIFT;
-			} else {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_DREXIT1;
-			}
-			break;
-		case LIBXSVF_TAP_DRSHIFT:
-			tap_transition(h, 1);
-			h->tap_state = LIBXSVF_TAP_DREXIT1;
-			break;
-		case LIBXSVF_TAP_DREXIT1:
-			if (s == LIBXSVF_TAP_DRPAUSE) {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_DRPAUSE;
-			} else {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_DRUPDATE;
-			}
-			break;
-		case LIBXSVF_TAP_DRPAUSE:
-			tap_transition(h, 1);
-			h->tap_state = LIBXSVF_TAP_DREXIT2;
-			break;
-		case LIBXSVF_TAP_DREXIT2:
-			if (s == LIBXSVF_TAP_DRSHIFT) {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_DRSHIFT;
-			} else {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_DRUPDATE;
-			}
-			break;
-		case LIBXSVF_TAP_DRUPDATE:
-			if (s == LIBXSVF_TAP_IDLE) {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_IDLE;
-			} else {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_DRSELECT;
-			}
-			break;
-
-		/* IR States */
-		case LIBXSVF_TAP_IRSELECT:
-			if (s == LIBXSVF_TAP_RESET) {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_RESET;
-			} else {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_IRCAPTURE;
-			}
-			break;
-		case LIBXSVF_TAP_IRCAPTURE:
-			if (s == LIBXSVF_TAP_IRSHIFT) {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_IRSHIFT;
-			} else {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_IREXIT1;
-			}
-			break;
-		case LIBXSVF_TAP_IRSHIFT:
-			tap_transition(h, 1);
-			h->tap_state = LIBXSVF_TAP_IREXIT1;
-			break;
-		case LIBXSVF_TAP_IREXIT1:
-			if (s == LIBXSVF_TAP_IRPAUSE) {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_IRPAUSE;
-			} else {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_IRUPDATE;
-			}
-			break;
-		case LIBXSVF_TAP_IRPAUSE:
-			tap_transition(h, 1);
-			h->tap_state = LIBXSVF_TAP_IREXIT2;
-			break;
-		case LIBXSVF_TAP_IREXIT2:
-			if (s == LIBXSVF_TAP_IRSHIFT) {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_IRSHIFT;
-			} else {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_IRUPDATE;
-			}
-			break;
-		case LIBXSVF_TAP_IRUPDATE:
-			if (s == LIBXSVF_TAP_IDLE) {
-				tap_transition(h, 0);
-				h->tap_state = LIBXSVF_TAP_IDLE;
-			} else {
-				tap_transition(h, 1);
-				h->tap_state = LIBXSVF_TAP_DRSELECT;
-			}
-			break;
+	int i, tms, len;
 
-		default:
-			LIBXSVF_HOST_REPORT_ERROR("Illegal tap state.");
-			return -1;
+	if (s == h->tap_state)
+		return 0;
+
+	if (h->tap_state < LIBXSVF_TAP_INIT || h->tap_state > LIBXSVF_TAP_IRUPDATE ||
+			s <= LIBXSVF_TAP_INIT || s > LIBXSVF_TAP_IRUPDATE) {
+		LIBXSVF_HOST_REPORT_ERROR("Illegal tap state.");
+		return -1;
+	}
+
+	tms = tap_path[h->tap_state][s].tms;
+	len = tap_path[h->tap_state][s].len;
+
+	if (h->tms_sequence) {
+		LIBXSVF_HOST_TMS_SEQUENCE(tms, len);
+		if (!h->report_tapstate) {
+			h->tap_state = s;
+			return 0;
 		}
+	}
+
+	for (i=0; i<len; i++) {
+		if (!h->tms_sequence)
+			tap_transition(h, (tms >> i) & 1);
+		/* the first five of the six TMS=1 pulses from INIT are not state changes */
+		if (h->tap_state == LIBXSVF_TAP_INIT && i < 5)
+			continue;
+		h->tap_state = tap_next[h->tap_state][(tms >> i) & 1];
 		if (h->report_tapstate)
 			LIBXSVF_HOST_REPORT_TAPSTATE();
-		if (i>10) {
-			LIBXSVF_HOST_REPORT_ERROR("Loop in tap walker.");
-			return -1;
-		}
 	}
 
 	return 0;
 }
+
+int libxsvf_tap_walk_len(enum libxsvf_tap_state from, enum libxsvf_tap_state to)
+{
+	if (from == to)
+		return 0;
+	if (from < LIBXSVF_TAP_INIT || from > LIBXSVF_TAP_IRUPDATE ||
+			to <= LIBXSVF_TAP_INIT || to > LIBXSVF_TAP_IRUPDATE)
+		return -1;
+	return tap_path[from][to].len;
+}
+
+/* walks between IDLE and the DR states never pass IRCAPTURE, IRUPDATE or RESET */
+int libxsvf_tap_keeps_ir(enum libxsvf_tap_state s)
+{
+	return s >= LIBXSVF_TAP_IDLE && s <= LIBXSVF_TAP_DRUPDATE;
+}
+
+int libxsvf_tap_shift(struct libxsvf_host *h, int len, const unsigned char *tdi_data, const unsigned char *tdi_mask,
+		const unsigned char *tdo_data, const unsigned char *tdo_mask, const unsigned char *ret_mask,
+		enum libxsvf_tap_state estate, int sync)
+{
+	int left_padding = (8 - len % 8) % 8;
+	int tms_last = h->tap_state != estate;
+	int tdo_error = 0;
+	int i, j;
+
+	if (len <= 0)
+		return 0;
+
+	if (h->shift) {
+		if (LIBXSVF_HOST_SHIFT(len, tdi_data, tdi_mask, tdo_data, tdo_mask, ret_mask, tms_last, sync) < 0)
+			tdo_error = 1;
+	} else {
+		/*
+		 * Walk the arrays a byte at a time, starting with the last byte.
+		 * Missing masks and data become all-ones or all-zero valid bits,
+		 * so the inner loop only shifts and masks.
+		 */
+		for (i=(len+7)/8-1; i >= 0; i--) {
+			int tdi_bits = tdi_data ? tdi_data[i] : 0;
+			int tdi_valid = tdi_data ? (tdi_mask ? tdi_mask[i] : 0xff) : 0;
+			int tdo_bits = tdo_data ? tdo_data[i] : 0;
+			int tdo_valid = tdo_data ? (tdo_mask ? tdo_mask[i] : 0xff) : 0;
+			int rmask_bits = ret_mask ? ret_mask[i] : 0;
+			int bits = i == 0 ? 8 - left_padding : 8;
+			for (j=0; j < bits; j++) {
+				int last = i == 0 && j == bits-1;
+				int tdi = (tdi_valid >> j) & 1 ? (tdi_bits >> j) & 1 : -1;
+				int tdo = (tdo_valid >> j) & 1 ? (tdo_bits >> j) & 1 : -1;
+				if (LIBXSVF_HOST_PULSE_TCK(tms_last && last, tdi, tdo, (rmask_bits >> j) & 1, sync && last) < 0)
+					tdo_error = 1;
+			}
+		}
+	}
+
+	if (tms_last) {
+		h->tap_state++;
+		LIBXSVF_HOST_REPORT_TAPSTATE();
+	}
+
+	return tdo_error ? -1 : 0;
+}
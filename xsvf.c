@@ -46,29 +46,54 @@ enum xsvf_cmd {
 	XWAIT           = 0x17,
 	/* Extensions used in svf2xsvf.py */
 	XWAITSTATE      = 0x18,
-	XTRST           = 0x1c
+	XTRST           = 0x1c,
+	/* Extension of libxsvf: the vectors of the following command are compressed */
+	XCOMPRESSED     = 0x1d
 };
 
+/*
+ * A compressed vector is a sequence of runs. Each run starts with a byte
+ * holding the run type in the upper two bits and the length minus one in
+ * the lower six bits. A length field of 63 is followed by two bytes (big
+ * endian) holding the length minus 64. Literal runs are followed by their
+ * bytes and fill runs by the byte value. Keep runs leave the bytes of the
+ * previous vector (of the same kind) in place, so no memory beyond the
+ * register buffers is needed to decompress.
+ */
+enum xsvf_run {
+	XSVF_RUN_LITERAL = 0,
+	XSVF_RUN_FILL = 1,
+	XSVF_RUN_KEEP = 2
+};
+
+#define XSVF_RUN_MAX (64 + 0xffff)
+
 // This is to not confuse the VIM syntax highlighting
 #define VAL_OPEN (
 #define VAL_CLOSE )
 
 #define READ_BITS(_buf, _len) do {                                          \
-	unsigned char *_p = _buf; int _i;                                   \
-	for (_i=0; _i<(_len); _i+=8) {                                      \
-		int tmp = LIBXSVF_HOST_GETBYTE();                           \
-		if (tmp < 0) {                                              \
-			LIBXSVF_HOST_REPORT_ERROR("Unexpected EOF.");       \
-			goto error;                                         \
-		}                                                           \
-		*(_p++) = tmp;                                              \
+	if (libxsvf_read(h, _buf, bits2bytes(_len)) < 0) {                  \
+		LIBXSVF_HOST_REPORT_ERROR("Unexpected EOF.");               \
+		goto error;                                                 \
 	}                                                                   \
 } while (0)
 
+#define LOADED(_which) (1 << LIBXSVF_MEM_XSVF_ ## _which)
+
+#define READ_VECTOR(_buf, _which, _len) do {                                \
+	if (!compressed)                                                    \
+		READ_BITS(st->_buf, _len);                                  \
+	else if (xsvf_read_compressed(h, st->_buf, bits2bytes(_len),         \
+			st->loaded & LOADED(_which)) < 0)                   \
+		goto error;                                                 \
+	st->loaded |= LOADED(_which);                                       \
+} while (0)
+
 #define READ_LONG() VAL_OPEN{                                               \
 	long _buf = 0; int _i;                                              \
 	for (_i=0; _i<4; _i++) {                                            \
-		int tmp = LIBXSVF_HOST_GETBYTE();                           \
+		int tmp = LIBXSVF_GETBYTE();                           \
 		if (tmp < 0) {                                              \
 			LIBXSVF_HOST_REPORT_ERROR("Unexpected EOF.");       \
 			goto error;                                         \
@@ -79,7 +104,7 @@ enum xsvf_cmd {
 }VAL_CLOSE
 
 #define READ_BYTE() VAL_OPEN{                                               \
-	int _tmp = LIBXSVF_HOST_GETBYTE();                                  \
+	int _tmp = LIBXSVF_GETBYTE();                                  \
 	if (_tmp < 0) {                                                     \
 		LIBXSVF_HOST_REPORT_ERROR("Unexpected EOF.");               \
 		goto error;                                                 \
@@ -88,13 +113,13 @@ enum xsvf_cmd {
 }VAL_CLOSE
 
 #define SHIFT_DATA(_inp, _outp, _maskp, _len, _state, _estate, _edelay, _ret) do { \
-	if (shift_data(h, _inp, _outp, _maskp, _len, _state, _estate, _edelay, _ret) < 0) { \
+	if (libxsvf_op_xshift(h, _len, _inp, _outp, _maskp, _state, _estate, _edelay, _ret) < 0) { \
 		goto error;                                                 \
 	}                                                                   \
 } while (0)
 
 #define TAP(_state) do {                                                    \
-	if (libxsvf_tap_walk(h, _state) < 0)                                \
+	if (libxsvf_op_tap(h, _state) < 0)                                  \
 		goto error;                                                 \
 } while (0)
 
@@ -103,7 +128,7 @@ static int bits2bytes(int bits)
 	return (bits+7) / 8;
 }
 
-static int getbit(unsigned char *data, int n)
+static int getbit(const unsigned char *data, int n)
 {
 	return (data[n/8] & (1 << (7 - n%8))) ? 1 : 0;
 }
@@ -117,6 +142,68 @@ static void setbit(unsigned char *data, int n, int v)
 		data[n/8] &= ~mask;
 }
 
+/* keep is set when buf holds a vector that was loaded since the last XSDRSIZE */
+static int xsvf_read_compressed(struct libxsvf_host *h, unsigned char *buf, long bytes, int keep)
+{
+	long i = 0, n;
+	int c, v, lo;
+
+	while (i < bytes) {
+		c = LIBXSVF_GETBYTE();
+		if (c < 0)
+			goto eof;
+		n = (c & 0x3f) + 1;
+		if (n == 64) {
+			v = LIBXSVF_GETBYTE();
+			lo = LIBXSVF_GETBYTE();
+			if (v < 0 || lo < 0)
+				goto eof;
+			n = 64 + (v << 8 | lo);
+		}
+		if (n > bytes - i || c >> 6 > XSVF_RUN_KEEP || (c >> 6 == XSVF_RUN_KEEP && !keep)) {
+			LIBXSVF_HOST_REPORT_ERROR("Invalid compressed XSVF vector.");
+			return -1;
+		}
+		if (c >> 6 == XSVF_RUN_LITERAL && libxsvf_read(h, buf + i, n) < 0)
+			goto eof;
+		if (c >> 6 == XSVF_RUN_FILL) {
+			v = LIBXSVF_GETBYTE();
+			if (v < 0)
+				goto eof;
+			while (n--)
+				buf[i++] = v;
+			continue;
+		}
+		i += n;
+	}
+	return 0;
+
+eof:
+	LIBXSVF_HOST_REPORT_ERROR("Unexpected EOF.");
+	return -1;
+}
+
+/* number of register vectors of the commands that can be compressed, 0 for the others */
+static int xsvf_vectors(int cmd)
+{
+	switch (cmd)
+	{
+	case XTDOMASK:
+	case XSDR:
+	case XSDRB:
+	case XSDRC:
+	case XSDRE:
+		return 1;
+	case XSDRTDO:
+	case XSETSDRMASKS:
+	case XSDRTDOB:
+	case XSDRTDOC:
+	case XSDRTDOE:
+		return 2;
+	}
+	return 0;
+}
+
 static int xilinx_tap(int state)
 {
 	/* state codes as defined in xilinx xapp503 */
@@ -174,313 +261,1255 @@ static int xilinx_tap(int state)
 	return -1;
 }
 
-static int shift_data(struct libxsvf_host *h, unsigned char *inp, unsigned char *outp, unsigned char *maskp, int len, enum libxsvf_tap_state state, enum libxsvf_tap_state estate, int edelay, int retries)
+struct xsvf_state {
+	unsigned char *buf_tdi_data;
+	unsigned char *buf_tdo_data;
+	unsigned char *buf_tdo_mask;
+	unsigned char *buf_addr_mask;
+	unsigned char *buf_data_mask;
+	int *sdrinc_runs;
+	int sdrinc_addr_runs, sdrinc_data_runs;
+	int loaded;  /* LOADED() bits of the buffers loaded since XSDRSIZE */
+	long state_dr_size;
+	long state_data_size;
+	long state_runtest;
+	unsigned char state_xendir;
+	unsigned char state_xenddr;
+	unsigned char state_retries;
+	unsigned char cmd;
+	unsigned char *cmd_buf;
+	int cmd_buf_len, cmd_len;
+	long cmd_offset;
+	int synced;
+	unsigned char ir_last[32];
+	int ir_last_len;
+};
+
+/* number of bytes in the compressed vector starting at buf, or more than len if they are not all there */
+static long xsvf_compressed_len(const unsigned char *buf, long len, long bytes)
+{
+	long pos = 0, i = 0, n;
+	int type;
+
+	while (i < bytes) {
+		if (pos >= len)
+			return len+1;
+		type = buf[pos] >> 6;
+		n = (buf[pos++] & 0x3f) + 1;
+		if (n == 64) {
+			if (pos + 2 > len)
+				return len+1;
+			n = 64 + (buf[pos] << 8 | buf[pos+1]);
+			pos += 2;
+		}
+		if (type == XSVF_RUN_LITERAL)
+			pos += n;
+		if (type == XSVF_RUN_FILL)
+			pos++;
+		i += n;
+	}
+
+	return pos;
+}
+
+/* number of bytes in the command starting at buf, or len+1 if more bytes are needed to tell */
+static long xsvf_cmdlen(struct xsvf_state *st, const unsigned char *buf, int len)
 {
-	int left_padding = (8 - len % 8) % 8;
-	int with_retries = retries > 0;
+	long dr_bytes = bits2bytes(st->state_dr_size);
+	long n;
 	int i;
 
-	if (with_retries && LIBXSVF_HOST_SYNC() < 0) {
-		LIBXSVF_HOST_REPORT_ERROR("TDO mismatch.");
-		return -1;
+	if (len < 1)
+		return 1;
+
+	switch (buf[0])
+	{
+	case XCOMPLETE:
+		return 1;
+	case XTDOMASK:
+	case XSDR:
+	case XSDRB:
+	case XSDRC:
+	case XSDRE:
+		return 1 + dr_bytes;
+	case XSDRTDO:
+	case XSETSDRMASKS:
+	case XSDRTDOB:
+	case XSDRTDOC:
+	case XSDRTDOE:
+		return 1 + 2*dr_bytes;
+	case XSIR:
+		if (len < 2)
+			return len+1;
+		return 2 + bits2bytes(buf[1]);
+	case XSIR2:
+		if (len < 3)
+			return len+1;
+		return 3 + bits2bytes(buf[1] << 8 | buf[2]);
+	case XSDRINC:
+		if (len < 2 + dr_bytes)
+			return 2 + dr_bytes;
+		return 2 + dr_bytes + buf[1 + dr_bytes] * bits2bytes(st->state_data_size);
+	case XRUNTEST:
+	case XSDRSIZE:
+		return 5;
+	case XREPEAT:
+	case XSTATE:
+	case XENDIR:
+	case XENDDR:
+	case XTRST:
+		return 2;
+	case XWAIT:
+		return 7;
+	case XWAITSTATE:
+		return 11;
+	case XCOMPRESSED:
+		if (len < 2)
+			return len+1;
+		n = 2;
+		for (i=xsvf_vectors(buf[1]); i>0 && n<=len; i--)
+			n += xsvf_compressed_len(buf + n, len - n, dr_bytes);
+		return n;
+	case XCOMMENT:
+		for (n=1; n<len; n++)
+			if (buf[n] == 0)
+				return n+1;
+		return len+1;
+	}
+
+	/* unknown commands are reported by xsvf_command() */
+	return 1;
+}
+
+/* make sure the next command is available in h->block, returns 0 if more input must be fed first */
+static int xsvf_fetch(struct libxsvf_host *h, struct xsvf_state *st)
+{
+	long need;
+	int i;
+
+	if (st->cmd_len == 0) {
+		need = xsvf_cmdlen(st, h->block + h->block_pos, h->block_len - h->block_pos);
+		if (need <= h->block_len - h->block_pos || (h->block_pos == h->block_len && h->push_eof))
+			return 1;
+	}
+
+	while (1) {
+		need = xsvf_cmdlen(st, st->cmd_buf, st->cmd_len);
+		if (need <= st->cmd_len)
+			break;
+		if (h->block_pos == h->block_len) {
+			if (h->push_eof)
+				break;
+			return 0;
+		}
+		if (need > st->cmd_buf_len) {
+			st->cmd_buf_len = need < 64 ? 64 : need;
+			st->cmd_buf = LIBXSVF_HOST_REALLOC(st->cmd_buf, st->cmd_buf_len, LIBXSVF_MEM_XSVF_COMMANDBUF);
+			if (!st->cmd_buf) {
+				LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+				return -1;
+			}
+		}
+		for (i = st->cmd_len; i < need && h->block_pos < h->block_len; i++)
+			st->cmd_buf[i] = h->block[h->block_pos++];
+		st->cmd_len = i;
 	}
 
-	while (1)
+	return 2;
+}
+
+static int xsvf_needs_sync(struct libxsvf_host *h, struct xsvf_state *st)
+{
+	int cmd;
+
+	if (!h->sync || h->retry_batch > 0 || st->state_retries == 0 || h->block_pos == h->block_len)
+		return 0;
+
+	cmd = h->block[h->block_pos];
+	if (cmd == XCOMPRESSED && h->block_pos + 1 < h->block_len)
+		cmd = h->block[h->block_pos + 1];
+
+	switch (cmd)
 	{
-		int tdo_error = 0;
-		int tms = 0;
+	case XSIR:
+	case XSIR2:
+	case XSDR:
+	case XSDRTDO:
+	case XSDRINC:
+		return 1;
+	}
 
-		TAP(state);
-		tms = 0;
+	return 0;
+}
 
-		for (i=len+left_padding-1; i>=left_padding; i--) {
-			if (i == left_padding && h->tap_state != estate) {
-				h->tap_state++;
-				tms = 1;
+/*
+ * Register sized buffers. Only TDI is allocated by XSDRSIZE, the others are
+ * allocated (filled with zeros) by the first command that needs them, so
+ * files using just XSDRB/XSDRC/XSDRE or XSDR without TDO checks need one
+ * buffer. XSDRSIZE resizes the buffers that exist (resize set).
+ */
+static int xsvf_buffer(struct libxsvf_host *h, struct xsvf_state *st, unsigned char **buf, enum libxsvf_mem which, int resize)
+{
+	int i, bytes = bits2bytes(st->state_dr_size);
+	unsigned char *p;
+
+	if (resize ? !*buf : *buf || bytes == 0)
+		return 0;
+
+	p = LIBXSVF_HOST_REALLOC(*buf, bytes, which);
+	if (!p) {
+		LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+		return -1;
+	}
+	if (!*buf)
+		for (i=0; i<bytes; i++)
+			p[i] = 0;
+	*buf = p;
+	return 0;
+}
+
+/*
+ * XSETSDRMASKS: XSDRINC only touches the bits set in the address and data
+ * masks, so they are stored as runs of [first bit, bit count], the address
+ * runs followed by the data runs. This also sets state_data_size.
+ */
+static int xsvf_sdrinc_runs(struct libxsvf_host *h, struct xsvf_state *st)
+{
+	const unsigned char *masks[2] = { st->buf_addr_mask, st->buf_data_mask };
+	int *runs = (void*)0;
+	int pass, k, i, n = 0;
+
+	for (pass=0; pass<2; pass++) {
+		n = 0;
+		st->state_data_size = 0;
+		for (k=0; k<2; k++) {
+			for (i=0; masks[k] && i<st->state_dr_size; i++) {
+				if (!getbit(masks[k], i))
+					continue;
+				if (i == 0 || !getbit(masks[k], i-1)) {
+					if (runs) {
+						runs[2*n] = i;
+						runs[2*n+1] = 0;
+					}
+					n++;
+				}
+				if (runs)
+					runs[2*n-1]++;
+				if (k)
+					st->state_data_size++;
 			}
-			int tdi = getbit(inp, i);
-			int tdo = -1;
-			if (maskp && getbit(maskp, i))
-				tdo = outp && getbit(outp, i);
-			int sync = with_retries && i == left_padding;
-			if (LIBXSVF_HOST_PULSE_TCK(tms, tdi, tdo, 0, sync) < 0)
-				tdo_error = 1;
+			if (k == 0)
+				st->sdrinc_addr_runs = n;
+		}
+		st->sdrinc_data_runs = n - st->sdrinc_addr_runs;
+		if (pass || n == 0)
+			break;
+		runs = LIBXSVF_HOST_REALLOC(st->sdrinc_runs, 2*n*sizeof(int), LIBXSVF_MEM_XSVF_SDRINC_RUNS);
+		if (!runs) {
+			LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+			st->sdrinc_addr_runs = st->sdrinc_data_runs = 0;
+			return -1;
+		}
+		st->sdrinc_runs = runs;
+	}
+
+	return 0;
+}
+
+#define NEED_BUFFER(_buf, _which) do {                                      \
+	if (xsvf_buffer(h, st, &st->_buf, LIBXSVF_MEM_XSVF_ ## _which, 0) < 0) \
+		goto error;                                                 \
+} while (0)
+
+/*
+ * XSIR and XSIR2, which are checkpoints. With LIBXSVF_FLAG_SKIP_SAME_IR the shift is left out when
+ * the IR still holds the same bits, only the walk to the end state and the
+ * XRUNTEST wait are done. ir_last_len is -1 while the IR content is unknown.
+ */
+static int xsvf_sir(struct libxsvf_host *h, struct xsvf_state *st, const unsigned char *buf, int length)
+{
+	enum libxsvf_tap_state estate = st->state_xendir ? LIBXSVF_TAP_IRPAUSE : LIBXSVF_TAP_IDLE;
+	int i, bytes = bits2bytes(length);
+	int rc = libxsvf_checkpoint(h);
+
+	if (rc < 0)
+		return -1;
+	/* resuming here, the IR content is unknown */
+	if (rc > 0)
+		st->ir_last_len = -1;
+
+	if (st->state_runtest)
+		estate = LIBXSVF_TAP_IDLE;
+
+	if ((h->flags & LIBXSVF_FLAG_SKIP_SAME_IR) && st->ir_last_len == length && libxsvf_tap_keeps_ir(estate)) {
+		for (i=0; i<bytes; i++)
+			if (st->ir_last[i] != buf[i])
+				break;
+		if (i == bytes) {
+			h->skipped_ir_bits += length;
+			if (libxsvf_op_tap(h, estate) < 0)
+				return -1;
+			if (st->state_runtest)
+				return libxsvf_op_udelay(h, st->state_runtest, 0, st->state_runtest);
+			return 0;
 		}
+	}
+
+	if (libxsvf_op_xshift(h, length, buf, (void*)0, (void*)0, LIBXSVF_TAP_IRSHIFT,
+			st->state_xendir ? LIBXSVF_TAP_IRPAUSE : LIBXSVF_TAP_IDLE,
+			st->state_runtest, st->state_retries) < 0)
+		return -1;
+
+	st->ir_last_len = -1;
+	if (libxsvf_tap_keeps_ir(estate) && bytes <= (int)sizeof(st->ir_last)) {
+		for (i=0; i<bytes; i++)
+			st->ir_last[i] = buf[i];
+		st->ir_last_len = length;
+	}
+	return 0;
+}
 
-		if (tms)
-			LIBXSVF_HOST_REPORT_TAPSTATE();
-	
-		if (edelay) {
+static int xsvf_command(struct libxsvf_host *h, struct xsvf_state *st)
+{
+	unsigned char last_cmd = st->cmd;
+	unsigned char cmd;
+	int compressed = 0;
+	int i, j;
+
+	h->location.command++;
+	h->location.offset = st->cmd_len ? st->cmd_offset : h->block_offset + h->block_pos;
+
+	cmd = LIBXSVF_GETBYTE();
+	if (cmd == XCOMPRESSED) {
+		compressed = 1;
+		cmd = READ_BYTE();
+		if (!xsvf_vectors(cmd)) {
+			LIBXSVF_HOST_REPORT_ERROR("XSVF command can not be compressed.");
+			goto error;
+		}
+	}
+	st->cmd = cmd;
+
+#define STATUS(_c) LIBXSVF_HOST_REPORT_STATUS("XSVF Command " #_c);
+
+	switch (cmd)
+	{
+	case XCOMPLETE: {
+		STATUS(XCOMPLETE);
+		return LIBXSVF_STEP_DONE;
+	  }
+	case XTDOMASK: {
+		STATUS(XTDOMASK);
+		NEED_BUFFER(buf_tdo_mask, TDO_MASK);
+		READ_VECTOR(buf_tdo_mask, TDO_MASK, st->state_dr_size);
+		break;
+	  }
+	case XSIR: {
+		STATUS(XSIR);
+		int length = READ_BYTE();
+		unsigned char buf[bits2bytes(length)];
+		READ_BITS(buf, length);
+		if (xsvf_sir(h, st, buf, length) < 0)
+			goto error;
+		break;
+	  }
+	case XSDR: {
+		STATUS(XSDR);
+		NEED_BUFFER(buf_tdo_data, TDO_DATA);
+		NEED_BUFFER(buf_tdo_mask, TDO_MASK);
+		READ_VECTOR(buf_tdi_data, TDI_DATA, st->state_dr_size);
+		SHIFT_DATA(st->buf_tdi_data, st->buf_tdo_data, st->buf_tdo_mask, st->state_dr_size, LIBXSVF_TAP_DRSHIFT,
+				st->state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE,
+				st->state_runtest, st->state_retries);
+		break;
+	  }
+	case XRUNTEST: {
+		STATUS(XRUNTEST);
+		st->state_runtest = READ_LONG();
+		break;
+	  }
+	case XREPEAT: {
+		STATUS(XREPEAT);
+		st->state_retries = READ_BYTE();
+		break;
+	  }
+	case XSDRSIZE: {
+		STATUS(XSDRSIZE);
+		st->state_dr_size = READ_LONG();
+		st->loaded = 0;
+		st->buf_tdi_data = LIBXSVF_HOST_REALLOC(st->buf_tdi_data, bits2bytes(st->state_dr_size), LIBXSVF_MEM_XSVF_TDI_DATA);
+		if (!st->buf_tdi_data) {
+			LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+			goto error;
+		}
+		if (xsvf_buffer(h, st, &st->buf_tdo_data, LIBXSVF_MEM_XSVF_TDO_DATA, 1) < 0 ||
+				xsvf_buffer(h, st, &st->buf_tdo_mask, LIBXSVF_MEM_XSVF_TDO_MASK, 1) < 0 ||
+				xsvf_buffer(h, st, &st->buf_addr_mask, LIBXSVF_MEM_XSVF_ADDR_MASK, 1) < 0 ||
+				xsvf_buffer(h, st, &st->buf_data_mask, LIBXSVF_MEM_XSVF_DATA_MASK, 1) < 0)
+			goto error;
+		if (st->buf_addr_mask && xsvf_sdrinc_runs(h, st) < 0)
+			goto error;
+		break;
+	  }
+	case XSDRTDO: {
+		STATUS(XSDRTDO);
+		NEED_BUFFER(buf_tdo_data, TDO_DATA);
+		NEED_BUFFER(buf_tdo_mask, TDO_MASK);
+		READ_VECTOR(buf_tdi_data, TDI_DATA, st->state_dr_size);
+		READ_VECTOR(buf_tdo_data, TDO_DATA, st->state_dr_size);
+		SHIFT_DATA(st->buf_tdi_data, st->buf_tdo_data, st->buf_tdo_mask, st->state_dr_size, LIBXSVF_TAP_DRSHIFT,
+				st->state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE,
+				st->state_runtest, st->state_retries);
+		break;
+	  }
+	case XSETSDRMASKS: {
+		STATUS(XSETSDRMASKS);
+		NEED_BUFFER(buf_addr_mask, ADDR_MASK);
+		NEED_BUFFER(buf_data_mask, DATA_MASK);
+		READ_VECTOR(buf_addr_mask, ADDR_MASK, st->state_dr_size);
+		READ_VECTOR(buf_data_mask, DATA_MASK, st->state_dr_size);
+		if (xsvf_sdrinc_runs(h, st) < 0)
+			goto error;
+		break;
+	  }
+	case XSDRINC: {
+		STATUS(XSDRINC);
+		NEED_BUFFER(buf_tdo_data, TDO_DATA);
+		NEED_BUFFER(buf_tdo_mask, TDO_MASK);
+		READ_BITS(st->buf_tdi_data, st->state_dr_size);
+		st->loaded |= LOADED(TDI_DATA);
+		int num = READ_BYTE();
+		const int *runs = st->sdrinc_runs;
+		int r;
+		while (1) {
+			SHIFT_DATA(st->buf_tdi_data, st->buf_tdo_data, st->buf_tdo_mask, st->state_dr_size, LIBXSVF_TAP_DRSHIFT,
+					st->state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE,
+					st->state_runtest, st->state_retries);
+			if (num-- <= 0)
+				break;
+			/* increment the address, the carry stops at the first zero bit */
+			for (r=st->sdrinc_addr_runs-1; r>=0; r--) {
+				for (j=runs[2*r]+runs[2*r+1]-1; j>=runs[2*r]; j--) {
+					if (!getbit(st->buf_tdi_data, j))
+						break;
+					setbit(st->buf_tdi_data, j, 0);
+				}
+				if (j >= runs[2*r]) {
+					setbit(st->buf_tdi_data, j, 1);
+					break;
+				}
+			}
+			/* insert the data bits, a whole data byte at a time where it fits into the run */
+			unsigned char this_byte = 0;
+			for (r=st->sdrinc_addr_runs, i=0; r<st->sdrinc_addr_runs+st->sdrinc_data_runs; r++) {
+				int end = runs[2*r] + runs[2*r+1];
+				for (j=runs[2*r]; j<end; ) {
+					if (i%8 == 0 && end-j >= 8) {
+						unsigned char *d = st->buf_tdi_data + j/8;
+						int v = READ_BYTE(), sh = j%8;
+						d[0] = (d[0] & ~(0xff >> sh)) | v >> sh;
+						if (sh)
+							d[1] = (d[1] & (0xff >> sh)) | v << (8-sh);
+						i += 8;
+						j += 8;
+						continue;
+					}
+					if (i%8 == 0)
+						this_byte = READ_BYTE();
+					setbit(st->buf_tdi_data, j++, getbit(&this_byte, i++%8));
+				}
+			}
+		}
+		break;
+	  }
+	case XSDRB: {
+		STATUS(XSDRB);
+		READ_VECTOR(buf_tdi_data, TDI_DATA, st->state_dr_size);
+		SHIFT_DATA(st->buf_tdi_data, (void*)0, (void*)0, st->state_dr_size, LIBXSVF_TAP_DRSHIFT, LIBXSVF_TAP_DRSHIFT, 0, 0);
+		break;
+	  }
+	case XSDRC: {
+		STATUS(XSDRC);
+		READ_VECTOR(buf_tdi_data, TDI_DATA, st->state_dr_size);
+		SHIFT_DATA(st->buf_tdi_data, (void*)0, (void*)0, st->state_dr_size, LIBXSVF_TAP_DRSHIFT, LIBXSVF_TAP_DRSHIFT, 0, 0);
+		break;
+	  }
+	case XSDRE: {
+		STATUS(XSDRE);
+		READ_VECTOR(buf_tdi_data, TDI_DATA, st->state_dr_size);
+		SHIFT_DATA(st->buf_tdi_data, (void*)0, (void*)0, st->state_dr_size, LIBXSVF_TAP_DRSHIFT,
+				st->state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE, 0, 0);
+		break;
+	  }
+	case XSDRTDOB: {
+		STATUS(XSDRTDOB);
+		NEED_BUFFER(buf_tdo_data, TDO_DATA);
+		READ_VECTOR(buf_tdi_data, TDI_DATA, st->state_dr_size);
+		READ_VECTOR(buf_tdo_data, TDO_DATA, st->state_dr_size);
+		SHIFT_DATA(st->buf_tdi_data, st->buf_tdo_data, (void*)0, st->state_dr_size, LIBXSVF_TAP_DRSHIFT, LIBXSVF_TAP_DRSHIFT, 0, 0);
+		break;
+	  }
+	case XSDRTDOC: {
+		STATUS(XSDRTDOC);
+		NEED_BUFFER(buf_tdo_data, TDO_DATA);
+		READ_VECTOR(buf_tdi_data, TDI_DATA, st->state_dr_size);
+		READ_VECTOR(buf_tdo_data, TDO_DATA, st->state_dr_size);
+		SHIFT_DATA(st->buf_tdi_data, st->buf_tdo_data, (void*)0, st->state_dr_size, LIBXSVF_TAP_DRSHIFT, LIBXSVF_TAP_DRSHIFT, 0, 0);
+		break;
+	  }
+	case XSDRTDOE: {
+		STATUS(XSDRTDOE);
+		NEED_BUFFER(buf_tdo_data, TDO_DATA);
+		READ_VECTOR(buf_tdi_data, TDI_DATA, st->state_dr_size);
+		READ_VECTOR(buf_tdo_data, TDO_DATA, st->state_dr_size);
+		SHIFT_DATA(st->buf_tdi_data, st->buf_tdo_data, (void*)0, st->state_dr_size, LIBXSVF_TAP_DRSHIFT,
+				st->state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE, 0, 0);
+		break;
+	  }
+	case XSTATE: {
+		STATUS(XSTATE);
+		if (st->state_runtest && last_cmd == XRUNTEST) {
 			TAP(LIBXSVF_TAP_IDLE);
-			LIBXSVF_HOST_UDELAY(edelay, 0, edelay);
+			if (libxsvf_op_udelay(h, st->state_runtest, 0, st->state_runtest) < 0)
+				goto error;
+		}
+		unsigned char state = READ_BYTE();
+		TAP(xilinx_tap(state));
+		if (!libxsvf_tap_keeps_ir(xilinx_tap(state)))
+			st->ir_last_len = -1;
+		break;
+	  }
+	case XENDIR: {
+		STATUS(XENDIR);
+		st->state_xendir = READ_BYTE();
+		break;
+	  }
+	case XENDDR: {
+		STATUS(XENDDR);
+		st->state_xenddr = READ_BYTE();
+		break;
+	  }
+	case XSIR2: {
+		STATUS(XSIR2);
+		int length = READ_BYTE();
+		length = length << 8 | READ_BYTE();
+		unsigned char buf[bits2bytes(length)];
+		READ_BITS(buf, length);
+		if (xsvf_sir(h, st, buf, length) < 0)
+			goto error;
+		break;
+	  }
+	case XCOMMENT: {
+		STATUS(XCOMMENT);
+		unsigned char this_byte;
+		do {
+			this_byte = READ_BYTE();
+		} while (this_byte);
+		break;
+	  }
+	case XWAIT:
+	case XWAITSTATE: {
+		STATUS(XWAIT);
+		unsigned char state1 = READ_BYTE();
+		unsigned char state2 = READ_BYTE();
+		long count = 0, usecs;
+		if (cmd==XWAITSTATE) {
+			count = READ_LONG();   /* XWAITSTATE has count, time arguments */
+		}
+		usecs = READ_LONG();
+		TAP(xilinx_tap(state1));
+		if (libxsvf_op_udelay(h, usecs, 0, count) < 0)
+			goto error;
+		TAP(xilinx_tap(state2));
+		if (!libxsvf_tap_keeps_ir(xilinx_tap(state1)) || !libxsvf_tap_keeps_ir(xilinx_tap(state2)))
+			st->ir_last_len = -1;
+		break;
+	  }
+	case XTRST: {
+		STATUS(XTRST);
+		int v = READ_BYTE();  /* enum: ON, OFF, Z, ABSENT */
+		st->ir_last_len = -1;
+		if (libxsvf_op_trst(h, v == 0 ? 1 : v == 1 ? 0 : v == 2 ? -1 : -2) < 0)
+			goto error;
+		break;
+	}
+	default:
+		LIBXSVF_HOST_REPORT_ERROR("Unknown XSVF command.");
+		goto error;
+	}
+
+	return LIBXSVF_STEP_CONTINUE;
+
+error:
+	return LIBXSVF_STEP_ERROR;
+}
+
+int libxsvf_xsvf_start(struct libxsvf_host *h)
+{
+	struct xsvf_state *st = LIBXSVF_HOST_REALLOC((void*)0, sizeof(struct xsvf_state), LIBXSVF_MEM_XSVF_STATE);
+
+	if (!st) {
+		LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+		return -1;
+	}
+
+	st->buf_tdi_data = (void*)0;
+	st->buf_tdo_data = (void*)0;
+	st->buf_tdo_mask = (void*)0;
+	st->buf_addr_mask = (void*)0;
+	st->buf_data_mask = (void*)0;
+	st->sdrinc_runs = (void*)0;
+	st->sdrinc_addr_runs = st->sdrinc_data_runs = 0;
+	st->loaded = 0;
+
+	st->state_dr_size = 0;
+	st->state_data_size = 0;
+	st->state_runtest = 0;
+	st->state_xendir = 0;
+	st->state_xenddr = 0;
+	st->state_retries = 0;
+	st->cmd = 0;
+
+	st->cmd_buf = (void*)0;
+	st->cmd_buf_len = 0;
+	st->cmd_len = 0;
+	st->cmd_offset = 0;
+	st->synced = 0;
+	st->ir_last_len = -1;
+
+	h->run_data = st;
+	return 0;
+}
+
+int libxsvf_xsvf_step(struct libxsvf_host *h)
+{
+	struct xsvf_state *st = h->run_data;
+	const unsigned char *block = h->block;
+	int block_len = h->block_len;
+	int block_pos = h->block_pos;
+	int rc;
+
+	if (!h->push_mode)
+		return xsvf_command(h, st);
+
+	rc = xsvf_fetch(h, st);
+	if (rc < 0)
+		return LIBXSVF_STEP_ERROR;
+	if (rc == 0)
+		return LIBXSVF_STEP_NEED_INPUT;
+
+	if (rc == 2) {
+		st->cmd_offset = h->block_offset + h->block_pos - st->cmd_len;
+		block = h->block;
+		block_len = h->block_len;
+		block_pos = h->block_pos;
+		h->block = st->cmd_buf;
+		h->block_len = st->cmd_len;
+		h->block_pos = 0;
+	}
+
+	if (!st->synced && xsvf_needs_sync(h, st)) {
+		st->synced = 1;
+		rc = LIBXSVF_STEP_NEED_SYNC;
+	} else {
+		st->synced = 0;
+		rc = xsvf_command(h, st);
+		if (h->block == st->cmd_buf)
+			st->cmd_len = 0;
+	}
+
+	if (h->block == st->cmd_buf) {
+		h->block = block;
+		h->block_len = block_len;
+		h->block_pos = block_pos;
+	}
+
+	return rc;
+}
+
+int libxsvf_xsvf_finish(struct libxsvf_host *h, int rc)
+{
+	struct xsvf_state *st = h->run_data;
+
+	if (!st)
+		return rc;
+
+	if (rc >= 0 && libxsvf_op_sync(h) < 0)
+		rc = -1;
+
+	LIBXSVF_HOST_REALLOC(st->buf_tdi_data, 0, LIBXSVF_MEM_XSVF_TDI_DATA);
+	LIBXSVF_HOST_REALLOC(st->buf_tdo_data, 0, LIBXSVF_MEM_XSVF_TDO_DATA);
+	LIBXSVF_HOST_REALLOC(st->buf_tdo_mask, 0, LIBXSVF_MEM_XSVF_TDO_MASK);
+	LIBXSVF_HOST_REALLOC(st->buf_addr_mask, 0, LIBXSVF_MEM_XSVF_ADDR_MASK);
+	LIBXSVF_HOST_REALLOC(st->buf_data_mask, 0, LIBXSVF_MEM_XSVF_DATA_MASK);
+	LIBXSVF_HOST_REALLOC(st->sdrinc_runs, 0, LIBXSVF_MEM_XSVF_SDRINC_RUNS);
+	LIBXSVF_HOST_REALLOC(st->cmd_buf, 0, LIBXSVF_MEM_XSVF_COMMANDBUF);
+	LIBXSVF_HOST_REALLOC(st, 0, LIBXSVF_MEM_XSVF_STATE);
+	h->run_data = (void*)0;
+
+	return rc;
+}
+
+int libxsvf_xsvf(struct libxsvf_host *h)
+{
+	int rc;
+
+	if (libxsvf_xsvf_start(h) < 0)
+		return -1;
+
+	do {
+		rc = libxsvf_xsvf_step(h);
+	} while (rc > 0);
+
+	return libxsvf_xsvf_finish(h, rc);
+}
+
+/*
+ * SVF to XSVF conversion: the SVF file is compiled to a program and the
+ * program operations are translated to XSVF commands. The generated file
+ * replays the same TCK/TMS/TDI sequence as the SVF file when played back.
+ */
+
+#define SVF2XSVF_MAX_SEGMENTS 16
+
+struct svf2xsvf_segment {
+	int len;
+	const unsigned char *tdi_data;
+	const unsigned char *tdo_data;
+	const unsigned char *tdo_mask;
+};
+
+struct svf2xsvf_state {
+	unsigned char *buf;
+	int buf_len, buf_alloc;
+	unsigned char *scratch;
+	int scratch_len;
+	unsigned char *prev;
+	int prev_len, prev_valid;
+	enum libxsvf_tap_state tap_state;
+	long dr_size;
+	int xenddr, xendir, in_scan, sir_tdo_warned;
+	struct svf2xsvf_segment seg[SVF2XSVF_MAX_SEGMENTS];
+	int seg_num;
+	long seg_len;
+};
+
+static int put_bytes(struct libxsvf_host *h, struct svf2xsvf_state *cs, const unsigned char *data, int len)
+{
+	int i;
+
+	if (cs->buf_len + len > cs->buf_alloc) {
+		int alloc = cs->buf_alloc < 1024 ? 1024 : cs->buf_alloc*2;
+		while (alloc < cs->buf_len + len)
+			alloc *= 2;
+		unsigned char *p = LIBXSVF_HOST_REALLOC(cs->buf, alloc, LIBXSVF_MEM_SVF2XSVF_DATA);
+		if (!p) {
+			LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+			return -1;
+		}
+		cs->buf = p;
+		cs->buf_alloc = alloc;
+	}
+
+	for (i=0; i<len; i++)
+		cs->buf[cs->buf_len++] = data[i];
+	return 0;
+}
+
+static int put_byte(struct libxsvf_host *h, struct svf2xsvf_state *cs, int v)
+{
+	unsigned char b = v;
+	return put_bytes(h, cs, &b, 1);
+}
+
+static int put_long(struct libxsvf_host *h, struct svf2xsvf_state *cs, long v)
+{
+	unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+	return put_bytes(h, cs, b, 4);
+}
+
+/* one run of a compressed vector, longer runs are split */
+static int put_run(struct libxsvf_host *h, struct svf2xsvf_state *cs, int type, const unsigned char *data, long n)
+{
+	while (n > 0) {
+		long len = n < XSVF_RUN_MAX ? n : XSVF_RUN_MAX;
+		if (len < 64) {
+			if (put_byte(h, cs, type << 6 | (len-1)) < 0)
+				return -1;
 		} else {
-			TAP(estate);
+			if (put_byte(h, cs, type << 6 | 63) < 0 || put_byte(h, cs, (len-64) >> 8) < 0 || put_byte(h, cs, len-64) < 0)
+				return -1;
 		}
+		if (type == XSVF_RUN_LITERAL && put_bytes(h, cs, data, len) < 0)
+			return -1;
+		if (type == XSVF_RUN_FILL && put_byte(h, cs, data[0]) < 0)
+			return -1;
+		if (type == XSVF_RUN_LITERAL)
+			data += len;
+		n -= len;
+	}
+	return 0;
+}
 
-		if (!tdo_error)
-			return 0;
+/* compress a vector, prev is the vector the player has in its buffer (or null if it is not known) */
+static int put_compressed(struct libxsvf_host *h, struct svf2xsvf_state *cs, const unsigned char *data, const unsigned char *prev, long bytes)
+{
+	long i = 0, lit = 0, keep, fill;
 
-		if (retries <= 0) {
-			LIBXSVF_HOST_REPORT_ERROR("TDO mismatch.");
+	while (i < bytes) {
+		for (keep=0; prev && i+keep < bytes && data[i+keep] == prev[i+keep]; keep++) { }
+		for (fill=1; i+fill < bytes && data[i+fill] == data[i]; fill++) { }
+		if (keep < 3 && fill < 4) {
+			i++;
+			continue;
+		}
+		if (put_run(h, cs, XSVF_RUN_LITERAL, data + lit, i - lit) < 0)
 			return -1;
+		if (keep >= fill) {
+			if (put_run(h, cs, XSVF_RUN_KEEP, (void*)0, keep) < 0)
+				return -1;
+			i += keep;
+		} else {
+			if (put_run(h, cs, XSVF_RUN_FILL, data + i, fill) < 0)
+				return -1;
+			i += fill;
 		}
+		lit = i;
+	}
 
-		retries--;
+	return put_run(h, cs, XSVF_RUN_LITERAL, data + lit, i - lit);
+}
+
+/*
+ * A command with nvec register vectors of the given kinds (0: TDI, 1: TDO,
+ * 2: TDO mask) from the scratch buffer. cs->prev holds the last vector of
+ * each kind since the last XSDRSIZE, as the player has them in its
+ * buffers. With LIBXSVF_FLAG_COMPRESS_XSVF the vectors are compressed if
+ * this makes the command shorter.
+ */
+static int put_vectors(struct libxsvf_host *h, struct svf2xsvf_state *cs, int cmd, int kind, int nvec, int bytes)
+{
+	int start = cs->buf_len;
+	int i, k;
+
+	if (3*bytes > cs->prev_len) {
+		unsigned char *p = LIBXSVF_HOST_REALLOC(cs->prev, 3*bytes, LIBXSVF_MEM_SVF2XSVF_PREVIOUS);
+		if (!p) {
+			LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+			return -1;
+		}
+		cs->prev = p;
+		cs->prev_len = 3*bytes;
+		cs->prev_valid = 0;
 	}
 
-error:
-	return -1;
+	if (h->flags & LIBXSVF_FLAG_COMPRESS_XSVF) {
+		if (put_byte(h, cs, XCOMPRESSED) < 0 || put_byte(h, cs, cmd) < 0)
+			return -1;
+		for (k=kind; k<kind+nvec; k++)
+			if (put_compressed(h, cs, cs->scratch + k*bytes, (cs->prev_valid & (1 << k)) ? cs->prev + k*bytes : (void*)0, bytes) < 0)
+				return -1;
+		if (cs->buf_len - start >= 1 + nvec*bytes)
+			cs->buf_len = start;
+	}
+
+	if (cs->buf_len == start) {
+		if (put_byte(h, cs, cmd) < 0 || put_bytes(h, cs, cs->scratch + kind*bytes, nvec*bytes) < 0)
+			return -1;
+	}
+
+	for (i=kind*bytes; i<(kind+nvec)*bytes; i++)
+		cs->prev[i] = cs->scratch[i];
+	for (k=kind; k<kind+nvec; k++)
+		cs->prev_valid |= 1 << k;
+	return 0;
 }
 
-int libxsvf_xsvf(struct libxsvf_host *h)
+static int put_state(struct libxsvf_host *h, struct svf2xsvf_state *cs, enum libxsvf_tap_state s)
 {
-	int rc = 0;
-	int i, j;
+	if (cs->tap_state == s)
+		return 0;
+	cs->tap_state = s;
+	/* xapp503 state codes are in the same order as enum libxsvf_tap_state */
+	if (put_byte(h, cs, XSTATE) < 0 || put_byte(h, cs, s - LIBXSVF_TAP_RESET) < 0)
+		return -1;
+	return 0;
+}
+
+/* build the XSVF vectors for the bits pos .. pos+len-1 of the queued shift segments */
+static int build_chunk(struct libxsvf_host *h, struct svf2xsvf_state *cs, long pos, int len, int *tdo_bits)
+{
+	int bytes = bits2bytes(len);
+	unsigned char *tdi, *tdo, *mask;
+	long seg_pos = 0;
+	int i, j, k;
+
+	if (3*bytes > cs->scratch_len) {
+		unsigned char *p = LIBXSVF_HOST_REALLOC(cs->scratch, 3*bytes, LIBXSVF_MEM_SVF2XSVF_BUFFER);
+		if (!p) {
+			LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
+			return -1;
+		}
+		cs->scratch = p;
+		cs->scratch_len = 3*bytes;
+	}
+
+	tdi = cs->scratch;
+	tdo = tdi + bytes;
+	mask = tdo + bytes;
+	for (i=0; i<3*bytes; i++)
+		cs->scratch[i] = 0;
+
+	*tdo_bits = 0;
+	for (k=0; k<cs->seg_num; k++) {
+		struct svf2xsvf_segment *seg = &cs->seg[k];
+		int seg_bits = bits2bytes(seg->len) * 8;
+		for (j=0; j<seg->len; j++) {
+			long p = seg_pos + j - pos;
+			if (p < 0)
+				continue;
+			if (p >= len)
+				break;
+			/* bit arrays are right-aligned: the first bit shifted is the LSB of the last byte */
+			int o = bytes*8 - 1 - p;
+			int b = seg_bits - 1 - j;
+			if (seg->tdi_data && getbit(seg->tdi_data, b))
+				setbit(tdi, o, 1);
+			if (seg->tdo_data && (!seg->tdo_mask || getbit(seg->tdo_mask, b))) {
+				setbit(mask, o, 1);
+				if (getbit(seg->tdo_data, b))
+					setbit(tdo, o, 1);
+				(*tdo_bits)++;
+			}
+		}
+		seg_pos += seg->len;
+	}
+
+	return 0;
+}
+
+static int put_sir(struct libxsvf_host *h, struct svf2xsvf_state *cs, enum libxsvf_tap_state estate)
+{
+	int len = cs->seg_len;
+	int tdo_bits;
+
+	if (estate != LIBXSVF_TAP_IDLE && estate != LIBXSVF_TAP_IRPAUSE) {
+		LIBXSVF_HOST_REPORT_ERROR("SIR end state can not be converted to XSVF.");
+		return -1;
+	}
+	if (len > 0xffff) {
+		LIBXSVF_HOST_REPORT_ERROR("SIR command too long for XSVF.");
+		return -1;
+	}
+
+	if (build_chunk(h, cs, 0, len, &tdo_bits) < 0)
+		return -1;
+
+	if (tdo_bits && !cs->sir_tdo_warned) {
+		LIBXSVF_HOST_REPORT_ERROR("WARNING: TDO checks in SIR commands can not be converted to XSVF and are ignored.");
+		cs->sir_tdo_warned = 1;
+	}
+
+	if (cs->xendir != (estate == LIBXSVF_TAP_IRPAUSE)) {
+		cs->xendir = estate == LIBXSVF_TAP_IRPAUSE;
+		if (put_byte(h, cs, XENDIR) < 0 || put_byte(h, cs, cs->xendir) < 0)
+			return -1;
+	}
+
+	if (len <= 0xff) {
+		if (put_byte(h, cs, XSIR) < 0 || put_byte(h, cs, len) < 0)
+			return -1;
+	} else {
+		if (put_byte(h, cs, XSIR2) < 0 || put_byte(h, cs, len >> 8) < 0 || put_byte(h, cs, len) < 0)
+			return -1;
+	}
+	if (put_bytes(h, cs, cs->scratch, bits2bytes(len)) < 0)
+		return -1;
+
+	cs->tap_state = estate;
+	return 0;
+}
+
+static int put_sdr_size(struct libxsvf_host *h, struct svf2xsvf_state *cs, int len)
+{
+	if (cs->dr_size == len)
+		return 0;
+	cs->dr_size = len;
+	/* the player reallocates its buffers, so the mask must be sent again and the vectors are not known */
+	cs->prev_valid = 0;
+	if (put_byte(h, cs, XSDRSIZE) < 0 || put_long(h, cs, len) < 0)
+		return -1;
+	return 0;
+}
+
+static int put_sdr(struct libxsvf_host *h, struct svf2xsvf_state *cs, enum libxsvf_tap_state estate, int max_chunk)
+{
+	int len, bytes, tdo_bits, i, cmd;
+	int split = cs->in_scan || estate == LIBXSVF_TAP_DRSHIFT;
+	long pos;
+
+	if (estate != LIBXSVF_TAP_DRSHIFT) {
+		if (estate != LIBXSVF_TAP_IDLE && estate != LIBXSVF_TAP_DRPAUSE) {
+			LIBXSVF_HOST_REPORT_ERROR("SDR end state can not be converted to XSVF.");
+			return -1;
+		}
+		if (cs->xenddr != (estate == LIBXSVF_TAP_DRPAUSE)) {
+			cs->xenddr = estate == LIBXSVF_TAP_DRPAUSE;
+			if (put_byte(h, cs, XENDDR) < 0 || put_byte(h, cs, cs->xenddr) < 0)
+				return -1;
+		}
+	}
+
+	/* XSDRTDO[BCE] check all TDO bits, so only scans with a trivial mask can be split */
+	if (!split && max_chunk > 0 && cs->seg_len > max_chunk) {
+		split = 1;
+		for (pos = 0; split && pos < cs->seg_len; pos += max_chunk) {
+			len = cs->seg_len - pos < max_chunk ? cs->seg_len - pos : max_chunk;
+			if (build_chunk(h, cs, pos, len, &tdo_bits) < 0)
+				return -1;
+			if (tdo_bits != 0 && tdo_bits != len)
+				split = 0;
+		}
+	}
+
+	if (!split) {
+		len = cs->seg_len;
+		bytes = bits2bytes(len);
+		if (build_chunk(h, cs, 0, len, &tdo_bits) < 0)
+			return -1;
+		if (put_sdr_size(h, cs, len) < 0)
+			return -1;
+		for (i=0; (cs->prev_valid & 4) && i<bytes; i++)
+			if (cs->prev[2*bytes+i] != cs->scratch[2*bytes+i])
+				break;
+		if ((cs->prev_valid & 4) == 0 || i < bytes) {
+			if (put_vectors(h, cs, XTDOMASK, 2, 1, bytes) < 0)
+				return -1;
+		}
+		if (put_vectors(h, cs, tdo_bits ? XSDRTDO : XSDR, 0, tdo_bits ? 2 : 1, bytes) < 0)
+			return -1;
+		cs->tap_state = estate;
+		return 0;
+	}
 
-	unsigned char *buf_tdi_data = (void*)0;
-	unsigned char *buf_tdo_data = (void*)0;
-	unsigned char *buf_tdo_mask = (void*)0;
-	unsigned char *buf_addr_mask = (void*)0;
-	unsigned char *buf_data_mask = (void*)0;
-
-	long state_dr_size = 0;
-	long state_data_size = 0;
-	long state_runtest = 0;
-	unsigned char state_xendir = 0;
-	unsigned char state_xenddr = 0;
-	unsigned char state_retries = 0;
-	unsigned char cmd = 0;
-
-	while (1)
+	for (pos = 0; pos < cs->seg_len; pos += len)
 	{
-		unsigned char last_cmd = cmd;
-		cmd = LIBXSVF_HOST_GETBYTE();
+		int last;
 
-#define STATUS(_c) LIBXSVF_HOST_REPORT_STATUS("XSVF Command " #_c);
+		len = cs->seg_len - pos;
+		if (max_chunk > 0 && len > max_chunk)
+			len = max_chunk;
+		bytes = bits2bytes(len);
+		last = pos + len == cs->seg_len && estate != LIBXSVF_TAP_DRSHIFT;
 
-		switch (cmd)
-		{
-		case XCOMPLETE: {
-			STATUS(XCOMPLETE);
-			goto got_complete_command;
-		  }
-		case XTDOMASK: {
-			STATUS(XTDOMASK);
-			READ_BITS(buf_tdo_mask, state_dr_size);
-			break;
-		  }
-		case XSIR: {
-			STATUS(XSIR);
-			int length = READ_BYTE();
-			unsigned char buf[bits2bytes(length)];
-			READ_BITS(buf, length);
-			SHIFT_DATA(buf, (void*)0, (void*)0, length, LIBXSVF_TAP_IRSHIFT,
-					state_xendir ? LIBXSVF_TAP_IRPAUSE : LIBXSVF_TAP_IDLE,
-					state_runtest, state_retries);
-			break;
-		  }
-		case XSDR: {
-			STATUS(XSDR);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			SHIFT_DATA(buf_tdi_data, buf_tdo_data, buf_tdo_mask, state_dr_size, LIBXSVF_TAP_DRSHIFT,
-					state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE,
-					state_runtest, state_retries);
-			break;
-		  }
-		case XRUNTEST: {
-			STATUS(XRUNTEST);
-			state_runtest = READ_LONG();
-			break;
-		  }
-		case XREPEAT: {
-			STATUS(XREPEAT);
-			state_retries = READ_BYTE();
+		if (build_chunk(h, cs, pos, len, &tdo_bits) < 0)
+			return -1;
+		if (tdo_bits != 0 && tdo_bits != len) {
+			LIBXSVF_HOST_REPORT_ERROR("Masked TDO check in a split SDR command can not be converted to XSVF.");
+			return -1;
+		}
+
+		if (tdo_bits)
+			cmd = !cs->in_scan ? XSDRTDOB : last ? XSDRTDOE : XSDRTDOC;
+		else
+			cmd = !cs->in_scan ? XSDRB : last ? XSDRE : XSDRC;
+
+		if (put_sdr_size(h, cs, len) < 0)
+			return -1;
+		if (put_vectors(h, cs, cmd, 0, tdo_bits ? 2 : 1, bytes) < 0)
+			return -1;
+
+		cs->in_scan = !last;
+	}
+
+	cs->tap_state = estate;
+	return 0;
+}
+
+static int put_scan(struct libxsvf_host *h, struct svf2xsvf_state *cs, enum libxsvf_tap_state estate, int max_chunk)
+{
+	int rc;
+
+	if (cs->seg_num == 0)
+		return 0;
+
+	if (cs->tap_state == LIBXSVF_TAP_IRSHIFT)
+		rc = put_sir(h, cs, estate);
+	else
+		rc = put_sdr(h, cs, estate, max_chunk);
+
+	cs->seg_num = 0;
+	cs->seg_len = 0;
+	return rc;
+}
+
+static const struct libxsvf_op *svf2xsvf_op(const struct libxsvf_program *prog, int i, struct libxsvf_op *op)
+{
+	const struct libxsvf_program_op *pop = &prog->ops[i];
+
+	*op = pop->op;
+	if (pop->data[0] >= 0)
+		op->tdi_data = prog->data + pop->data[0];
+	if (pop->data[2] >= 0)
+		op->tdo_data = prog->data + pop->data[2];
+	if (pop->data[3] >= 0)
+		op->tdo_mask = prog->data + pop->data[3];
+	if (pop->data[4] >= 0)
+		op->ret_mask = prog->data + pop->data[4];
+	return op;
+}
+
+/* index of the next operation that is not an empty shift */
+static int svf2xsvf_next(const struct libxsvf_program *prog, int i)
+{
+	for (i++; i < prog->ops_num; i++)
+		if (prog->ops[i].op.type != LIBXSVF_OP_SHIFT || prog->ops[i].op.len > 0)
 			break;
-		  }
-		case XSDRSIZE: {
-			STATUS(XSDRSIZE);
-			state_dr_size = READ_LONG();
-			buf_tdi_data = LIBXSVF_HOST_REALLOC(buf_tdi_data, bits2bytes(state_dr_size), LIBXSVF_MEM_XSVF_TDI_DATA);
-			buf_tdo_data = LIBXSVF_HOST_REALLOC(buf_tdo_data, bits2bytes(state_dr_size), LIBXSVF_MEM_XSVF_TDO_DATA);
-			buf_tdo_mask = LIBXSVF_HOST_REALLOC(buf_tdo_mask, bits2bytes(state_dr_size), LIBXSVF_MEM_XSVF_TDO_MASK);
-			buf_addr_mask = LIBXSVF_HOST_REALLOC(buf_addr_mask, bits2bytes(state_dr_size), LIBXSVF_MEM_XSVF_ADDR_MASK);
-			buf_data_mask = LIBXSVF_HOST_REALLOC(buf_data_mask, bits2bytes(state_dr_size), LIBXSVF_MEM_XSVF_DATA_MASK);
-			if (!buf_tdi_data || !buf_tdo_data || !buf_tdo_mask || !buf_addr_mask || !buf_data_mask) {
-				LIBXSVF_HOST_REPORT_ERROR("Allocating memory failed.");
-				goto error;
+	return i;
+}
+
+static int svf2xsvf_convert(struct libxsvf_host *h, struct svf2xsvf_state *cs, const struct libxsvf_program *prog, int max_chunk)
+{
+	struct libxsvf_op op_buf;
+	int i, next;
+
+	if (put_byte(h, cs, XREPEAT) < 0 || put_byte(h, cs, 0) < 0)
+		return -1;
+
+	for (i=0; i < prog->ops_num; i++)
+	{
+		const struct libxsvf_op *op = svf2xsvf_op(prog, i, &op_buf);
+		next = svf2xsvf_next(prog, i);
+		h->location = prog->ops[i].location;
+
+		if (op->type == LIBXSVF_OP_SHIFT) {
+			if (op->len <= 0)
+				continue;
+			if (cs->tap_state != LIBXSVF_TAP_DRSHIFT && cs->tap_state != LIBXSVF_TAP_IRSHIFT) {
+				LIBXSVF_HOST_REPORT_ERROR("Shift outside of DRSHIFT or IRSHIFT state.");
+				return -1;
 			}
-			break;
-		  }
-		case XSDRTDO: {
-			STATUS(XSDRTDO);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			READ_BITS(buf_tdo_data, state_dr_size);
-			SHIFT_DATA(buf_tdi_data, buf_tdo_data, buf_tdo_mask, state_dr_size, LIBXSVF_TAP_DRSHIFT,
-					state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE,
-					state_runtest, state_retries);
-			break;
-		  }
-		case XSETSDRMASKS: {
-			STATUS(XSETSDRMASKS);
-			READ_BITS(buf_addr_mask, state_dr_size);
-			READ_BITS(buf_data_mask, state_dr_size);
-			state_data_size = 0;
-			for (i=0; i<state_dr_size; i++)
-				state_data_size += getbit(buf_data_mask, i);
-			break;
-		  }
-		case XSDRINC: {
-			STATUS(XSDRINC);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			int num = READ_BYTE();
-			while (1) {
-				SHIFT_DATA(buf_tdi_data, buf_tdo_data, buf_tdo_mask, state_dr_size, LIBXSVF_TAP_DRSHIFT,
-						state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE,
-						state_runtest, state_retries);
-				if (num-- <= 0)
+			if (op->ret_mask) {
+				LIBXSVF_HOST_REPORT_ERROR("RMASK can not be converted to XSVF.");
+				return -1;
+			}
+			if (cs->seg_num == SVF2XSVF_MAX_SEGMENTS && put_scan(h, cs, cs->tap_state, max_chunk) < 0)
+				return -1;
+			struct svf2xsvf_segment *seg = &cs->seg[cs->seg_num++];
+			seg->len = op->len;
+			seg->tdi_data = op->tdi_data;
+			seg->tdo_data = op->tdo_data;
+			seg->tdo_mask = op->tdo_mask;
+			cs->seg_len += op->len;
+			if (op->estate != cs->tap_state && put_scan(h, cs, op->estate, max_chunk) < 0)
+				return -1;
+			continue;
+		}
+
+		/* a scan that stays in the shift state is continued by the next command */
+		if (put_scan(h, cs, cs->tap_state, max_chunk) < 0)
+			return -1;
+
+		switch (op->type)
+		{
+		case LIBXSVF_OP_TAP:
+			if (op->state == cs->tap_state)
+				break;
+			cs->in_scan = 0;
+			/* XSIR, XSDR and XWAIT walk to their start state themselves */
+			if (next < prog->ops_num) {
+				const struct libxsvf_op *nop = &prog->ops[next].op;
+				if (nop->type == LIBXSVF_OP_SHIFT && (op->state == LIBXSVF_TAP_DRSHIFT || op->state == LIBXSVF_TAP_IRSHIFT)) {
+					cs->tap_state = op->state;
 					break;
-				int carry = 1;
-				for (i=state_dr_size-1; i>=0; i--) {
-					if (getbit(buf_addr_mask, i) == 0)
-						continue;
-					if (getbit(buf_tdi_data, i)) {
-						setbit(buf_tdi_data, i, !carry);
-					} else {
-						setbit(buf_tdi_data, i, carry);
-						carry = 0;
-					}
 				}
-				unsigned char this_byte = 0;
-				for (i=0, j=0; i<state_data_size; i++) {
-					if (i%8 == 0)
-						this_byte = READ_BYTE();
-					while (getbit(buf_data_mask, j) == 0)
-						j++;
-					setbit(buf_tdi_data, j++, getbit(&this_byte, i%8));
+				if (nop->type == LIBXSVF_OP_UDELAY && nop->tms == 0) {
+					cs->tap_state = op->state;
+					break;
 				}
 			}
+			if (put_state(h, cs, op->state) < 0)
+				return -1;
 			break;
-		  }
-		case XSDRB: {
-			STATUS(XSDRB);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			SHIFT_DATA(buf_tdi_data, (void*)0, (void*)0, state_dr_size, LIBXSVF_TAP_DRSHIFT, LIBXSVF_TAP_DRSHIFT, 0, 0);
-			break;
-		  }
-		case XSDRC: {
-			STATUS(XSDRC);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			SHIFT_DATA(buf_tdi_data, (void*)0, (void*)0, state_dr_size, LIBXSVF_TAP_DRSHIFT, LIBXSVF_TAP_DRSHIFT, 0, 0);
-			break;
-		  }
-		case XSDRE: {
-			STATUS(XSDRE);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			SHIFT_DATA(buf_tdi_data, (void*)0, (void*)0, state_dr_size, LIBXSVF_TAP_DRSHIFT,
-					state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE, 0, 0);
-			break;
-		  }
-		case XSDRTDOB: {
-			STATUS(XSDRTDOB);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			READ_BITS(buf_tdo_data, state_dr_size);
-			SHIFT_DATA(buf_tdi_data, buf_tdo_data, (void*)0, state_dr_size, LIBXSVF_TAP_DRSHIFT, LIBXSVF_TAP_DRSHIFT, 0, 0);
-			break;
-		  }
-		case XSDRTDOC: {
-			STATUS(XSDRTDOC);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			READ_BITS(buf_tdo_data, state_dr_size);
-			SHIFT_DATA(buf_tdi_data, buf_tdo_data, (void*)0, state_dr_size, LIBXSVF_TAP_DRSHIFT, LIBXSVF_TAP_DRSHIFT, 0, 0);
-			break;
-		  }
-		case XSDRTDOE: {
-			STATUS(XSDRTDOE);
-			READ_BITS(buf_tdi_data, state_dr_size);
-			READ_BITS(buf_tdo_data, state_dr_size);
-			SHIFT_DATA(buf_tdi_data, buf_tdo_data, (void*)0, state_dr_size, LIBXSVF_TAP_DRSHIFT,
-					state_xenddr ? LIBXSVF_TAP_DRPAUSE : LIBXSVF_TAP_IDLE, 0, 0);
-			break;
-		  }
-		case XSTATE: {
-			STATUS(XSTATE);
-			if (state_runtest && last_cmd == XRUNTEST) {
-				TAP(LIBXSVF_TAP_IDLE);
-				LIBXSVF_HOST_UDELAY(state_runtest, 0, state_runtest);
+		case LIBXSVF_OP_UDELAY: {
+			enum libxsvf_tap_state s1 = cs->tap_state, s2 = s1;
+			if (op->tms) {
+				LIBXSVF_HOST_REPORT_ERROR("Delay with TMS=1 can not be converted to XSVF.");
+				return -1;
 			}
-			unsigned char state = READ_BYTE();
-			TAP(xilinx_tap(state));
-			break;
-		  }
-		case XENDIR: {
-			STATUS(XENDIR);
-			state_xendir = READ_BYTE();
+			if (next < prog->ops_num && prog->ops[next].op.type == LIBXSVF_OP_TAP) {
+				s2 = prog->ops[next].op.state;
+				i = next;
+			}
+			if (put_byte(h, cs, op->num_tck ? XWAITSTATE : XWAIT) < 0)
+				return -1;
+			if (put_byte(h, cs, s1 - LIBXSVF_TAP_RESET) < 0 || put_byte(h, cs, s2 - LIBXSVF_TAP_RESET) < 0)
+				return -1;
+			if (op->num_tck && put_long(h, cs, op->num_tck) < 0)
+				return -1;
+			if (put_long(h, cs, op->value) < 0)
+				return -1;
+			if (s2 != s1)
+				cs->in_scan = 0;
+			cs->tap_state = s2;
 			break;
 		  }
-		case XENDDR: {
-			STATUS(XENDDR);
-			state_xenddr = READ_BYTE();
+		case LIBXSVF_OP_TRST:
+			/* enum: ON, OFF, Z, ABSENT */
+			if (put_byte(h, cs, XTRST) < 0 || put_byte(h, cs, op->value == 1 ? 0 : op->value == 0 ? 1 : op->value == -1 ? 2 : 3) < 0)
+				return -1;
 			break;
-		  }
-		case XSIR2: {
-			STATUS(XSIR2);
-			int length = READ_BYTE();
-			length = length << 8 | READ_BYTE();
-			unsigned char buf[bits2bytes(length)];
-			READ_BITS(buf, length);
-			SHIFT_DATA(buf, (void*)0, (void*)0, length, LIBXSVF_TAP_IRSHIFT,
-					state_xendir ? LIBXSVF_TAP_IRPAUSE : LIBXSVF_TAP_IDLE,
-					state_runtest, state_retries);
+		case LIBXSVF_OP_FREQUENCY:
+			LIBXSVF_HOST_REPORT_ERROR("WARNING: FREQUENCY command can not be converted to XSVF and is ignored.");
 			break;
-		  }
-		case XCOMMENT: {
-			STATUS(XCOMMENT);
-			unsigned char this_byte;
-			do {
-				this_byte = READ_BYTE();
-			} while (this_byte);
+		case LIBXSVF_OP_SYNC:
 			break;
-		  }
-		case XWAIT:
-		case XWAITSTATE: {
-			STATUS(XWAIT);
-			unsigned char state1 = READ_BYTE();
-			unsigned char state2 = READ_BYTE();
-			long usecs = READ_LONG();
-			TAP(xilinx_tap(state1));
-			LIBXSVF_HOST_UDELAY(usecs, 0, 0);
-			TAP(xilinx_tap(state2));
-			if (cmd==XWAITSTATE) {
-				READ_LONG();   /* XWAITSTATE has count, time arguments */
-			}
-			break;
-		  }
-		case XTRST: {
-			STATUS(XTRST);
-			READ_BYTE();  /* enum: ON, OFF, Z, ABSENT */
-			break;
-		}
+		case LIBXSVF_OP_SCK:
+			LIBXSVF_HOST_REPORT_ERROR("SCK can not be converted to XSVF.");
+			return -1;
 		default:
-			LIBXSVF_HOST_REPORT_ERROR("Unknown XSVF command.");
-			goto error;
+			LIBXSVF_HOST_REPORT_ERROR("Operation can not be converted to XSVF.");
+			return -1;
 		}
 	}
 
-error:
-	rc = -1;
+	return put_byte(h, cs, XCOMPLETE);
+}
 
-got_complete_command:
-	if (LIBXSVF_HOST_SYNC() != 0 && rc >= 0 ) {
-		LIBXSVF_HOST_REPORT_ERROR("TDO mismatch.");
-		rc = -1;
-	}
+int libxsvf_svf2xsvf(struct libxsvf_host *h, int max_chunk, unsigned char **xsvf, int *xsvf_len)
+{
+	struct libxsvf_program prog;
+	struct svf2xsvf_state cs;
+	int rc;
 
-	LIBXSVF_HOST_REALLOC(buf_tdi_data, 0, LIBXSVF_MEM_XSVF_TDI_DATA);
-	LIBXSVF_HOST_REALLOC(buf_tdo_data, 0, LIBXSVF_MEM_XSVF_TDO_DATA);
-	LIBXSVF_HOST_REALLOC(buf_tdo_mask, 0, LIBXSVF_MEM_XSVF_TDO_MASK);
-	LIBXSVF_HOST_REALLOC(buf_addr_mask, 0, LIBXSVF_MEM_XSVF_ADDR_MASK);
-	LIBXSVF_HOST_REALLOC(buf_data_mask, 0, LIBXSVF_MEM_XSVF_DATA_MASK);
+	if (libxsvf_compile(h, &prog, LIBXSVF_MODE_SVF) < 0)
+		return -1;
 
-	return rc;
-}
+	cs.buf = (void*)0;
+	cs.buf_len = cs.buf_alloc = 0;
+	cs.scratch = (void*)0;
+	cs.scratch_len = 0;
+	cs.prev = (void*)0;
+	cs.prev_len = cs.prev_valid = 0;
+	cs.tap_state = LIBXSVF_TAP_INIT;
+	cs.dr_size = 0;
+	cs.xenddr = cs.xendir = 0;
+	cs.in_scan = cs.sir_tdo_warned = 0;
+	cs.seg_num = 0;
+	cs.seg_len = 0;
 
+	rc = svf2xsvf_convert(h, &cs, &prog, max_chunk);
+
+	libxsvf_program_free(h, &prog);
+	LIBXSVF_HOST_REALLOC(cs.scratch, 0, LIBXSVF_MEM_SVF2XSVF_BUFFER);
+	LIBXSVF_HOST_REALLOC(cs.prev, 0, LIBXSVF_MEM_SVF2XSVF_PREVIOUS);
+
+	if (rc < 0) {
+		LIBXSVF_HOST_REALLOC(cs.buf, 0, LIBXSVF_MEM_SVF2XSVF_DATA);
+		return -1;
+	}
+
+	*xsvf = cs.buf;
+	*xsvf_len = cs.buf_len;
+	return 0;
+}
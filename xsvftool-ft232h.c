@@ -35,24 +35,30 @@
  */
 
 #include "libxsvf.h"
+#include "xsvftool-input.h"
 
 #define BUFFER_SIZE (1024*16)
 
+// the locations of the commands that created the bits in the buffer and the read jobs
+#define LOCATIONS_SIZE (BUFFER_SIZE*2)
+
 #define BLOCK_WRITE
 // #define ASYNC_WRITE
 // #define BACKGROUND_READ
 // #define INTERLACED_READ_WRITE
+#define PARSE_AHEAD
 
 #include <sys/time.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
 #include <ftdi.h>
 #include <math.h>
-#ifdef BACKGROUND_READ
+#if defined BACKGROUND_READ || defined PARSE_AHEAD
 #  include <pthread.h>
 #endif
 
@@ -77,10 +83,12 @@ struct buffer_s {
 	unsigned int tdo:1;
 	unsigned int tdo_enable:1;
 	unsigned int rmask:1;
+	unsigned int location:16;
 };
 
 struct udata_s {
 	FILE *f;
+	struct xsvftool_input in;
 	struct ftdi_context ftdic;
 	uint16_t device_vendor;
 	uint16_t device_product;
@@ -92,6 +100,12 @@ struct udata_s {
 	int last_tms;
 	int last_tdo;
 	int buffer_i;
+	const struct libxsvf_location *location;
+	struct libxsvf_location locations[LOCATIONS_SIZE];
+	struct libxsvf_location error_location;
+	int locations_i;
+	const unsigned char *mask_ptr[2];
+	int mask_len[2], mask_full[2];
 	int retval_i;
 	int retval[256];
 	int error_rc;
@@ -238,6 +252,13 @@ static struct read_job_s *new_read_job(struct udata_s *u, int data_len, int bits
 	return job;
 }
 
+static void tdo_error(struct udata_s *u, struct buffer_s *b)
+{
+	if (u->error_rc == 0)
+		u->error_location = u->locations[b->location];
+	u->error_rc = -1;
+}
+
 static void transfer_tms_job_handler(struct udata_s *u, struct read_job_s *job, unsigned char *data)
 {
 	int i;
@@ -246,7 +267,7 @@ static void transfer_tms_job_handler(struct udata_s *u, struct read_job_s *job,
 		int bitpos = i + (8 - job->bits_len);
 		int line_tdo = (*data & (1 << bitpos)) != 0 ? 1 : 0;
 		if (job->buffer[i].tdo_enable && job->buffer[i].tdo != line_tdo)
-			u->error_rc = -1;
+			tdo_error(u, &job->buffer[i]);
 		if (job->buffer[i].rmask && u->retval_i < 256)
 			u->retval[u->retval_i++] = line_tdo;
 		u->last_tdo = line_tdo;
@@ -288,7 +309,7 @@ static void transfer_tdi_job_handler(struct udata_s *u, struct read_job_s *job,
 			int line_tdo = (data[j] & (1 << k)) != 0 ? 1 : 0;
 			if (job->buffer[i].tdo_enable && job->buffer[i].tdo != line_tdo)
 				if (!u->forcemode)
-					u->error_rc = -1;
+					tdo_error(u, &job->buffer[i]);
 			if (job->buffer[j*8+k].rmask && u->retval_i < 256)
 				u->retval[u->retval_i++] = line_tdo;
 		}
@@ -298,7 +319,7 @@ static void transfer_tdi_job_handler(struct udata_s *u, struct read_job_s *job,
 		int line_tdo = (data[bytes] & (1 << bitpos)) != 0 ? 1 : 0;
 		if (job->buffer[i].tdo_enable && job->buffer[i].tdo != line_tdo)
 			if (!u->forcemode)
-				u->error_rc = -1;
+				tdo_error(u, &job->buffer[i]);
 		if (job->buffer[i].rmask && u->retval_i < 256)
 			u->retval[u->retval_i++] = line_tdo;
 		u->last_tdo = line_tdo;
@@ -357,6 +378,36 @@ static void transfer_tdi(struct udata_s *u, struct buffer_s *d, int len)
 	}
 }
 
+// clock out whole TDI bytes without reading TDO, used for shifts that check nothing
+static void transfer_tdi_bytes(struct udata_s *u, const unsigned char *data, int bytes)
+{
+	int i, rc;
+
+	while (bytes > 0)
+	{
+		int len = bytes > 4096 ? 4096 : bytes;
+		unsigned char command[3 + len];
+
+		command[0] = 0x19;
+		command[1] = (len-1) & 0xff;
+		command[2] = (len-1) >> 8;
+		// libxsvf data is shifted starting with the LSB of the last byte
+		for (i=0; i<len; i++)
+			command[3+i] = data[-i];
+
+		write_dumpfile(1, command, 3 + len, 0);
+		rc = my_ftdi_write_data(u, command, 3 + len, 0);
+		if (rc != 3 + len) {
+			fprintf(stderr, "IO Error: Transfer tdi bytes write failed: %s (rc=%d/%d)\n",
+					ftdi_get_error_string(&u->ftdic), rc, 3 + len);
+			u->error_rc = -1;
+		}
+
+		data -= len;
+		bytes -= len;
+	}
+}
+
 static void process_next_read_job(struct udata_s *u)
 {
 	if (!u->job_fifo_out)
@@ -502,7 +553,18 @@ static void buffer_sync(struct udata_s *u)
 #endif
 }
 
-static void buffer_add(struct udata_s *u, int tms, int tdi, int tdo, int rmask)
+// the index in u->locations of the command that is played now, looked up once per callback
+static int buffer_location(struct udata_s *u)
+{
+	struct libxsvf_location *loc = &u->locations[u->locations_i];
+	if (loc->command != u->location->command || loc->offset != u->location->offset) {
+		u->locations_i = (u->locations_i + 1) % LOCATIONS_SIZE;
+		u->locations[u->locations_i] = *u->location;
+	}
+	return u->locations_i;
+}
+
+static void buffer_add(struct udata_s *u, int tms, int tdi, int tdo, int rmask, int location)
 {
 	u->buffer[u->buffer_i].tms = tms;
 	u->buffer[u->buffer_i].tdi = tdi;
@@ -510,6 +572,7 @@ static void buffer_add(struct udata_s *u, int tms, int tdi, int tdo, int rmask)
 	u->buffer[u->buffer_i].tdo = tdo;
 	u->buffer[u->buffer_i].tdo_enable = tdo >= 0;
 	u->buffer[u->buffer_i].rmask = rmask;
+	u->buffer[u->buffer_i].location = location;
 	u->buffer_i++;
 
 	if (u->buffer_i >= u->buffer_size)
@@ -644,6 +707,7 @@ found_device:;
 		return -1;
 	}
 
+	h->frequency = 2000000;
 	if (u->frequency > 0)
 		h->set_frequency(h, u->frequency);
 
@@ -652,6 +716,8 @@ found_device:;
 	u->last_tms = -1;
 	u->last_tdo = -1;
 	u->buffer_i = 0;
+	u->location = &h->location;
+	u->locations_i = 0;
 	u->error_rc = 0;
 
 #ifdef BACKGROUND_READ
@@ -697,12 +763,21 @@ static int h_shutdown(struct libxsvf_host *h)
 static void h_udelay(struct libxsvf_host *h, long usecs, int tms, long num_tck)
 {
 	struct udata_s *u = h->user_data;
+	int location = buffer_location(u);
+	if (usecs <= 0) {
+		// no wall-clock time to wait: just queue the clock cycles
+		while (num_tck > 0) {
+			buffer_add(u, tms, -1, -1, 0, location);
+			num_tck--;
+		}
+		return;
+	}
 	buffer_sync(u);
 	if (num_tck > 0) {
 		struct timeval tv1, tv2;
 		gettimeofday(&tv1, NULL);
 		while (num_tck > 0) {
-			buffer_add(u, tms, -1, -1, 0);
+			buffer_add(u, tms, -1, -1, 0, location);
 			num_tck--;
 		}
 		buffer_sync(u);
@@ -721,14 +796,28 @@ static void h_udelay(struct libxsvf_host *h, long usecs, int tms, long num_tck)
 static int h_getbyte(struct libxsvf_host *h)
 {
 	struct udata_s *u = h->user_data;
-	return fgetc(u->f);
+	return xsvftool_input_getbyte(&u->in);
+}
+
+static int h_getblock(struct libxsvf_host *h, const unsigned char **block)
+{
+	struct udata_s *u = h->user_data;
+	return xsvftool_input_getblock(&u->in, block);
+}
+
+// pass the location of a failed TDO check to libxsvf so it reports the right command
+static int error_rc(struct libxsvf_host *h, struct udata_s *u)
+{
+	if (u->error_rc < 0 && u->error_location.command && !h->error_location.command)
+		h->error_location = u->error_location;
+	return u->error_rc;
 }
 
 static int h_sync(struct libxsvf_host *h)
 {
 	struct udata_s *u = h->user_data;
 	buffer_sync(u);
-	int rc = u->error_rc;
+	int rc = error_rc(h, u);
 	u->error_rc = 0;
 	return rc;
 }
@@ -738,14 +827,90 @@ static int h_pulse_tck(struct libxsvf_host *h, int tms, int tdi, int tdo, int rm
 	struct udata_s *u = h->user_data;
 	if (u->syncmode)
 		sync = 1;
-	buffer_add(u, tms, tdi, tdo, rmask);
+	buffer_add(u, tms, tdi, tdo, rmask, buffer_location(u));
 	if (sync) {
 		buffer_sync(u);
-		int rc = u->error_rc < 0 ? u->error_rc : u->last_tdo;
+		int rc = u->error_rc < 0 ? error_rc(h, u) : u->last_tdo;
 		u->error_rc = 0;
 		return rc;
 	}
-	return u->error_rc < 0 ? u->error_rc : 1;
+	return u->error_rc < 0 ? error_rc(h, u) : 1;
+}
+
+static int getbit(const unsigned char *data, int n)
+{
+	return (data[n/8] & (1 << (7 - n%8))) ? 1 : 0;
+}
+
+// an all-ones mask is the same as no mask at all, the result is kept while
+// libxsvf reports the mask as unchanged
+static const unsigned char *h_shift_mask(struct udata_s *u, int n, const unsigned char *mask, int len, int same)
+{
+	int i, bytes = (len + 7) / 8;
+	if (!mask)
+		return NULL;
+	if (!same || mask != u->mask_ptr[n] || len != u->mask_len[n]) {
+		u->mask_ptr[n] = mask;
+		u->mask_len[n] = len;
+		u->mask_full[n] = ((mask[0] | (0xff00 >> (8 - len % 8) % 8)) & 0xff) == 0xff;
+		for (i = 1; i < bytes && u->mask_full[n]; i++)
+			if (mask[i] != 0xff)
+				u->mask_full[n] = 0;
+	}
+	return u->mask_full[n] ? NULL : mask;
+}
+
+static int h_shift(struct libxsvf_host *h, int len, const unsigned char *tdi_data, const unsigned char *tdi_mask,
+		const unsigned char *tdo_data, const unsigned char *tdo_mask, const unsigned char *ret_mask, int tms_last, int sync)
+{
+	struct udata_s *u = h->user_data;
+	int left_padding = (8 - len % 8) % 8;
+	int location = buffer_location(u);
+	int i;
+
+	tdi_mask = h_shift_mask(u, 0, tdi_mask, len, h->shift_same & LIBXSVF_SHIFT_SAME_TDI_MASK);
+	tdo_mask = h_shift_mask(u, 1, tdo_mask, len, h->shift_same & LIBXSVF_SHIFT_SAME_TDO_MASK);
+
+	i = len+left_padding-1;
+
+	// nothing to check or read back and the bits would not fit in the buffer
+	// anyway: flush it and send all but the last byte as they are
+	if (tdi_data && !tdi_mask && !tdo_data && !ret_mask && len > 8 && u->buffer_i + len > u->buffer_size) {
+		buffer_flush(u);
+		if (u->last_tms == 0) {
+			int bytes = (len-1) / 8;
+			transfer_tdi_bytes(u, tdi_data + (len+left_padding)/8 - 1, bytes);
+			i -= bytes*8;
+		}
+	}
+
+	for (; i >= left_padding; i--) {
+		int tdi = -1, tdo = -1;
+		if (tdi_data && (!tdi_mask || getbit(tdi_mask, i)))
+			tdi = getbit(tdi_data, i);
+		if (tdo_data && (!tdo_mask || getbit(tdo_mask, i)))
+			tdo = getbit(tdo_data, i);
+		buffer_add(u, tms_last && i == left_padding, tdi, tdo, ret_mask && getbit(ret_mask, i), location);
+	}
+
+	if (sync || u->syncmode) {
+		buffer_sync(u);
+		int rc = error_rc(h, u);
+		u->error_rc = 0;
+		return rc;
+	}
+	return error_rc(h, u);
+}
+
+static void h_tms_sequence(struct libxsvf_host *h, int tms, int count)
+{
+	struct udata_s *u = h->user_data;
+	int location = buffer_location(u);
+	int i;
+	for (i=0; i<count; i++)
+		buffer_add(u, (tms >> i) & 1, -1, -1, 0, location);
+	if (u->syncmode)
+		buffer_sync(u);
 }
 
 static int h_set_frequency(struct libxsvf_host *h, int v)
@@ -764,6 +929,8 @@ static int h_set_frequency(struct libxsvf_host *h, int v)
 				ftdi_get_error_string(&u->ftdic), rc, (int)sizeof(setfreq_command));
 		u->error_rc = -1;
 	}
+	// the actual TCK frequency, libxsvf uses it to turn waits into TCK cycles
+	h->frequency = 12000000 / (2 * (div + 1));
 	return 0;
 }
 
@@ -789,11 +956,28 @@ static void h_report_status(struct libxsvf_host *h, const char *message)
 
 static void h_report_error(struct libxsvf_host *h, const char *file, int line, const char *message)
 {
-	fprintf(stderr, "[%s:%d] %s\n", file, line, message);
+	const struct libxsvf_location *loc = h->error_location.command ? &h->error_location : &h->location;
+	if (loc->line > 0)
+		fprintf(stderr, "[%s:%d] %s (command %ld in line %ld)\n", file, line, message, loc->command, loc->line);
+	else if (loc->command > 0)
+		fprintf(stderr, "[%s:%d] %s (command %ld at offset %ld)\n", file, line, message, loc->command, loc->offset);
+	else
+		fprintf(stderr, "[%s:%d] %s\n", file, line, message);
 }
 
+static void *realloc_pool[LIBXSVF_MEM_NUM];
+static int realloc_poolsize[LIBXSVF_MEM_NUM];
+
 static void *h_realloc(struct libxsvf_host *h, void *ptr, int size, enum libxsvf_mem which)
 {
+	// libxsvf has at most one buffer per slot, so a preallocated buffer can be handed out again and again
+	if (realloc_pool[which]) {
+		if (size <= realloc_poolsize[which])
+			return size > 0 ? realloc_pool[which] : NULL;
+		ptr = realloc_pool[which];
+		realloc_pool[which] = NULL;
+		realloc_poolsize[which] = 0;
+	}
 	return realloc(ptr, size);
 }
 
@@ -805,8 +989,11 @@ static struct libxsvf_host h = {
 	.setup = h_setup,
 	.shutdown = h_shutdown,
 	.getbyte = h_getbyte,
+	.getblock = h_getblock,
 	.sync = h_sync,
 	.pulse_tck = h_pulse_tck,
+	.shift = h_shift,
+	.tms_sequence = h_tms_sequence,
 	.set_frequency = h_set_frequency,
 	.report_tapstate = h_report_tapstate,
 	.report_device = h_report_device,
@@ -843,7 +1030,7 @@ static void help()
 	fprintf(stderr, "Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>\n");
 	fprintf(stderr, "Lib(X)SVF is free software licensed under the ISC license.\n");
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Usage: %s [ -v[v..] ] [ -d dumpfile ] [ -L | -B ] [ -S ] [ -F ] \\\n", progname);
+	fprintf(stderr, "Usage: %s [ -v[v..] ] [ -d dumpfile ] [ -L | -B ] [ -S ] [ -F ] [ -k ] [ -a ] [ -P depth ] [ -T margin ] [ -b count ] \\\n", progname);
 	fprintf(stderr, "      %*s [ -D vendor:product ] [ -C channel ] [ -f freq[k|M] ] \\\n", (int)(strlen(progname)+1), "");
 	fprintf(stderr, "      %*s [ -Z eeprom-size] [ [-G] -W eeprom-filename ] [ -R eeprom-filename ] \\\n", (int)(strlen(progname)+1), "");
 	fprintf(stderr, "      %*s { -s svf-file | -x xsvf-file | -c } ...\n", (int)(strlen(progname)+1), "");
@@ -863,6 +1050,28 @@ static void help()
 	fprintf(stderr, "   -F\n");
 	fprintf(stderr, "          Force mode (ignore all TDO mismatches)\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "   -k\n");
+	fprintf(stderr, "          Keep the TAP state between files (no TAP reset after each file)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -a\n");
+	fprintf(stderr, "          Analyze each file before playing it: print the number of TCK cycles,\n");
+	fprintf(stderr, "          the wait time and the predicted duration, and preallocate all\n");
+	fprintf(stderr, "          buffers needed to play it\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -P depth\n");
+	fprintf(stderr, "          Parse the input in a second thread, up to the given number of JTAG\n");
+	fprintf(stderr, "          operations ahead of the player, e.g. 4096 (-v prints the wait times);\n");
+	fprintf(stderr, "          SVF files with LOOP commands and SVF from stdin are played directly\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -T margin\n");
+	fprintf(stderr, "          Wait by generating TCK cycles at the known clock frequency instead of\n");
+	fprintf(stderr, "          sleeping, with a safety margin of the given number of percent\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -b count\n");
+	fprintf(stderr, "          Play XSVF shifts with XREPEAT retries without waiting for each TDO\n");
+	fprintf(stderr, "          check, check up to the given number of shifts at once and replay\n");
+	fprintf(stderr, "          them from the first failed one (-v prints the number of replays)\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "   -f freq[k|M]\n");
 	fprintf(stderr, "          Set maximum frequency in Hz, kHz or MHz\n");
 	fprintf(stderr, "\n");
@@ -885,10 +1094,10 @@ static void help()
 	fprintf(stderr, "          Write content of the FTDI EEPROM to the given file\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -s svf-file\n");
-	fprintf(stderr, "          Play the specified SVF file\n");
+	fprintf(stderr, "          Play the specified SVF file (may be gzip or zlib compressed)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -x xsvf-file\n");
-	fprintf(stderr, "          Play the specified XSVF file\n");
+	fprintf(stderr, "          Play the specified XSVF file (may be gzip or zlib compressed)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -c\n");
 	fprintf(stderr, "          List devices in JTAG chain\n");
@@ -896,16 +1105,297 @@ static void help()
 	exit(1);
 }
 
+static int analyze(const char *filename, enum libxsvf_mode mode)
+{
+	struct libxsvf_stats stats;
+	int i;
+
+	// the frequency set by h_setup()
+	stats.frequency = u.frequency > 0 ? u.frequency : 2000000;
+	if (u.syncmode && stats.frequency > 10000)
+		stats.frequency = 10000;
+	if (libxsvf_analyze(&h, &stats, mode) < 0)
+		return -1;
+
+	printf("Analysis of `%s':\n", filename);
+	printf("  TCK cycles: %lld\n", stats.tck);
+	printf("  Checked TDO bits: %lld\n", stats.tdo_bits);
+	printf("  Wait time: %lld.%03lld s\n", stats.wait_usecs / 1000000, stats.wait_usecs / 1000 % 1000);
+	printf("  Predicted duration: %lld.%03lld s\n", stats.usecs / 1000000, stats.usecs / 1000 % 1000);
+
+	for (i = 0; i < LIBXSVF_MEM_NUM; i++) {
+		if (stats.mem_max[i] <= realloc_poolsize[i] || realloc_pool[i])
+			continue;
+		realloc_pool[i] = malloc(stats.mem_max[i]);
+		if (realloc_pool[i])
+			realloc_poolsize[i] = stats.mem_max[i];
+	}
+
+	return xsvftool_input_rewind(&u.in);
+}
+
+#ifdef PARSE_AHEAD
+
+// an operation parsed ahead, with copies of its bit arrays
+struct parse_entry_s {
+	struct libxsvf_op op;
+	struct libxsvf_location location;
+	int shift_same;
+	unsigned char *data;
+	int data_len;
+};
+
+struct parse_ahead_s {
+	struct libxsvf_host h;
+	enum libxsvf_mode mode;
+	struct parse_entry_s *entries;
+	int depth, first, num;
+	int parse_done, parse_rc, play_error;
+	int parse_waiting, play_waiting;
+	long long parse_wait, play_wait;
+	pthread_mutex_t mutex;
+	pthread_cond_t put_cond, get_cond;
+	pthread_t thread;
+};
+
+static struct parse_ahead_s parse_ahead;
+
+static long long usecs_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static const unsigned char *parse_entry_copy(struct parse_entry_s *e, int i, const unsigned char *src, int bytes)
+{
+	if (src == NULL)
+		return NULL;
+	memcpy(e->data + i * bytes, src, bytes);
+	return e->data + i * bytes;
+}
+
+// called in the parser thread for each operation
+static int parse_ahead_put_op(struct libxsvf_host *h, const struct libxsvf_op *op)
+{
+	struct parse_ahead_s *p = &parse_ahead;
+	int bytes = (op->len + 7) / 8;
+	struct parse_entry_s *e;
+	int play_error;
+
+	pthread_mutex_lock(&p->mutex);
+	if (p->num == p->depth && !p->play_error) {
+		long long t = usecs_now();
+		p->parse_waiting = 1;
+		while (p->num == p->depth && !p->play_error)
+			pthread_cond_wait(&p->put_cond, &p->mutex);
+		p->parse_waiting = 0;
+		p->parse_wait += usecs_now() - t;
+	}
+	e = &p->entries[(p->first + p->num) % p->depth];
+	play_error = p->play_error;
+	pthread_mutex_unlock(&p->mutex);
+
+	// the player failed, stop parsing
+	if (play_error)
+		return -1;
+
+	if (e->data_len < 5 * bytes) {
+		unsigned char *buf = realloc(e->data, 5 * bytes);
+		if (buf == NULL) {
+			fprintf(stderr, "Allocating memory failed.\n");
+			return -1;
+		}
+		e->data = buf;
+		e->data_len = 5 * bytes;
+	}
+
+	e->op = *op;
+	e->op.tdi_data = parse_entry_copy(e, 0, op->tdi_data, bytes);
+	e->op.tdi_mask = parse_entry_copy(e, 1, op->tdi_mask, bytes);
+	e->op.tdo_data = parse_entry_copy(e, 2, op->tdo_data, bytes);
+	e->op.tdo_mask = parse_entry_copy(e, 3, op->tdo_mask, bytes);
+	e->op.ret_mask = parse_entry_copy(e, 4, op->ret_mask, bytes);
+	e->location = h->location;
+	e->shift_same = h->shift_same;
+
+	// wake up the player only when the queue is half full, so the threads do not switch for every operation
+	pthread_mutex_lock(&p->mutex);
+	p->num++;
+	if (p->play_waiting && p->num >= (p->depth + 1) / 2)
+		pthread_cond_signal(&p->get_cond);
+	pthread_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+static void *parse_ahead_main(void *arg)
+{
+	struct parse_ahead_s *p = arg;
+	int rc = libxsvf_parse(&p->h, p->mode);
+
+	pthread_mutex_lock(&p->mutex);
+	p->parse_done = 1;
+	p->parse_rc = rc;
+	pthread_cond_signal(&p->get_cond);
+	pthread_mutex_unlock(&p->mutex);
+	return NULL;
+}
+
+// does the SVF file use LOOP? only looks at the first word of each command, then rewinds the file
+static int svf_has_loop(void)
+{
+	const unsigned char *block;
+	int len, i, loop = 0, comment = 0, cmd_start = 1, match = 0;
+
+	while (!loop && (len = xsvftool_input_getblock(&u.in, &block)) > 0) {
+		for (i = 0; i < len && !loop; i++) {
+			int ch = toupper(block[i]);
+			if (comment) {
+				comment = ch != '\n';
+				continue;
+			}
+			if (ch == '!' || ch == '/') {
+				comment = 1;
+				cmd_start = cmd_start && match == 0;
+				continue;
+			}
+			if (ch == ';') {
+				cmd_start = 1;
+				match = 0;
+				continue;
+			}
+			if (!cmd_start)
+				continue;
+			if (isspace(ch)) {
+				loop = match == 4;
+				cmd_start = match == 0;
+			} else if (match < 4 && ch == "LOOP"[match])
+				match++;
+			else
+				cmd_start = 0;
+		}
+	}
+
+	if (len < 0 || xsvftool_input_rewind(&u.in) < 0)
+		return -1;
+	return loop;
+}
+
+// SVF LOOP needs the TDO results of each pass, so such files are played directly
+static int parse_ahead_depth(enum libxsvf_mode mode, int depth)
+{
+	int loop;
+
+	if (depth <= 0 || mode != LIBXSVF_MODE_SVF)
+		return depth;
+
+	if (u.f == stdin) {
+		fprintf(stderr, "SVF input from stdin may use LOOP, playing it without parsing ahead.\n");
+		return 0;
+	}
+
+	loop = svf_has_loop();
+	if (loop > 0)
+		fprintf(stderr, "SVF file uses LOOP, playing it without parsing ahead.\n");
+	return loop < 0 ? -1 : loop ? 0 : depth;
+}
+
+// parse the file in a second thread while playing the operations that are already parsed
+static int play_parse_ahead(enum libxsvf_mode mode, int depth)
+{
+	struct parse_ahead_s *p = &parse_ahead;
+	struct libxsvf_location none = { 0, 0, 0 };
+	struct parse_entry_s *e;
+	int i, rc = 0;
+
+	if (p->depth != depth) {
+		for (i = 0; i < p->depth; i++)
+			free(p->entries[i].data);
+		free(p->entries);
+		p->entries = calloc(depth, sizeof(struct parse_entry_s));
+		p->depth = p->entries ? depth : 0;
+		if (p->entries == NULL) {
+			fprintf(stderr, "Allocating memory failed.\n");
+			return -1;
+		}
+		pthread_mutex_init(&p->mutex, NULL);
+		pthread_cond_init(&p->put_cond, NULL);
+		pthread_cond_init(&p->get_cond, NULL);
+	}
+
+	p->h = h;
+	p->h.put_op = parse_ahead_put_op;
+	p->mode = mode;
+	p->first = p->num = 0;
+	p->parse_done = p->play_error = 0;
+	p->parse_waiting = p->play_waiting = 0;
+	p->parse_wait = p->play_wait = 0;
+
+	h.location = none;
+	h.error_location = none;
+	h.retry_replays = 0;
+	pthread_create(&p->thread, NULL, &parse_ahead_main, p);
+
+	while (1)
+	{
+		pthread_mutex_lock(&p->mutex);
+		if (p->num == 0 && !p->parse_done) {
+			long long t = usecs_now();
+			p->play_waiting = 1;
+			while (p->num == 0 && !p->parse_done)
+				pthread_cond_wait(&p->get_cond, &p->mutex);
+			p->play_waiting = 0;
+			p->play_wait += usecs_now() - t;
+		}
+		if (p->num == 0) {
+			pthread_mutex_unlock(&p->mutex);
+			break;
+		}
+		e = &p->entries[p->first];
+		pthread_mutex_unlock(&p->mutex);
+
+		if (rc == 0) {
+			h.location = e->location;
+			h.shift_same = e->shift_same;
+			if (libxsvf_execute_op(&h, &e->op) < 0)
+				rc = -1;
+		}
+
+		pthread_mutex_lock(&p->mutex);
+		if (rc < 0)
+			p->play_error = 1;
+		p->first = (p->first + 1) % p->depth;
+		p->num--;
+		if (p->parse_waiting && (p->num <= p->depth / 2 || p->play_error))
+			pthread_cond_signal(&p->put_cond);
+		pthread_mutex_unlock(&p->mutex);
+	}
+
+	pthread_join(p->thread, NULL);
+	h.shift_same = 0;
+
+	if (u.verbose)
+		printf("Parse-ahead: the parser waited %lld ms for the player, the player waited %lld ms for the parser.\n",
+				p->parse_wait / 1000, p->play_wait / 1000);
+
+	return rc < 0 || p->parse_rc < 0 ? -1 : 0;
+}
+
+#endif
+
 int main(int argc, char **argv)
 {
 	int rc = 0;
 	int gotaction = 0;
+	int session = 0;
 	int genchecksum = 0;
 	int hex_mode = 0;
+	int analyze_files = 0;
+	int parse_depth = 0;
 	int opt, i, j;
 
 	progname = argc >= 1 ? argv[0] : "xsvftool-ft232h";
-	while ((opt = getopt(argc, argv, "vd:LBSFD:C:Z:GW:R:f:x:s:c")) != -1)
+	while ((opt = getopt(argc, argv, "vd:LBSFkaP:T:b:D:C:Z:GW:R:f:x:s:c")) != -1)
 	{
 		switch (opt)
 		{
@@ -922,6 +1412,15 @@ int main(int argc, char **argv)
 				rc = 1;
 			}
 			break;
+		case 'T':
+			h.flags |= LIBXSVF_FLAG_WAIT_TCK;
+			h.wait_margin = atoi(optarg);
+			if (h.wait_margin < 0)
+				help();
+			break;
+		case 'b':
+			h.retry_batch = atoi(optarg);
+			break;
 		case 'f':
 			u.frequency = strtol(optarg, &optarg, 10);
 			while (*optarg != 0) {
@@ -982,6 +1481,11 @@ int main(int argc, char **argv)
 		case 'W':
 			{
 				gotaction = 1;
+				if (session) {
+					if (libxsvf_close(&h) < 0)
+						rc = 1;
+					session = 0;
+				}
 				if (h_setup(&h) < 0)
 					return 1;
 				unsigned char eeprom_data[u.ftdic.eeprom_size];
@@ -1025,6 +1529,11 @@ int main(int argc, char **argv)
 		case 'R':
 			{
 				gotaction = 1;
+				if (session) {
+					if (libxsvf_close(&h) < 0)
+						rc = 1;
+					session = 0;
+				}
 				if (h_setup(&h) < 0)
 					return 1;
 				int eeprom_size = u.ftdic.eeprom_size;
@@ -1067,10 +1576,33 @@ int main(int argc, char **argv)
 				rc = 1;
 				break;
 			}
-			if (libxsvf_play(&h, opt == 's' ? LIBXSVF_MODE_SVF : LIBXSVF_MODE_XSVF) < 0) {
-				fprintf(stderr, "Error while playing %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
+			if (xsvftool_input_start(&u.in, u.f) < 0) {
+				rc = 1;
+			} else if (analyze_files && u.f != stdin && analyze(optarg, opt == 's' ? LIBXSVF_MODE_SVF : LIBXSVF_MODE_XSVF) < 0) {
+				fprintf(stderr, "Error while analyzing %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
+				rc = 1;
+			} else if (!session && libxsvf_open(&h) < 0) {
+				rc = 1;
+			} else {
+				session = 1;
+				enum libxsvf_mode mode = opt == 's' ? LIBXSVF_MODE_SVF : LIBXSVF_MODE_XSVF;
+#ifdef PARSE_AHEAD
+				int depth = parse_ahead_depth(mode, parse_depth);
+				if (depth < 0 || (depth > 0 ? play_parse_ahead(mode, depth) < 0 : libxsvf_run(&h, mode) < 0)) {
+#else
+				if (libxsvf_run(&h, mode) < 0) {
+#endif
+					fprintf(stderr, "Error while playing %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
+					rc = 1;
+				}
+				if (u.verbose && h.retry_batch > 0)
+					printf("Replayed %ld batches of retried shifts after a failed TDO check.\n", h.retry_replays);
+			}
+			if (u.in.error) {
+				fprintf(stderr, "Error while reading %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
 				rc = 1;
 			}
+			xsvftool_input_end(&u.in);
 			if (strcmp(optarg, "-"))
 				fclose(u.f);
 			break;
@@ -1079,9 +1611,19 @@ int main(int argc, char **argv)
 			int old_frequency = u.frequency;
 			if (u.frequency == 0)
 				u.frequency = 10000;
-			if (libxsvf_play(&h, LIBXSVF_MODE_SCAN) < 0) {
-				fprintf(stderr, "Error while scanning JTAG chain.\n");
+			if (!session && libxsvf_open(&h) < 0) {
 				rc = 1;
+			} else {
+				if (session && old_frequency == 0)
+					h_set_frequency(&h, u.frequency);
+				session = 1;
+				if (libxsvf_run(&h, LIBXSVF_MODE_SCAN) < 0) {
+					fprintf(stderr, "Error while scanning JTAG chain.\n");
+					rc = 1;
+				}
+				// back to the initial clk freq from h_setup()
+				if (old_frequency == 0)
+					h_set_frequency(&h, 2000000);
 			}
 			u.frequency = old_frequency;
 			break;
@@ -1099,6 +1641,15 @@ int main(int argc, char **argv)
 		case 'F':
 			u.forcemode = 1;
 			break;
+		case 'k':
+			h.flags |= LIBXSVF_FLAG_KEEP_TAPSTATE;
+			break;
+		case 'a':
+			analyze_files = 1;
+			break;
+		case 'P':
+			parse_depth = atoi(optarg);
+			break;
 		default:
 			help();
 			break;
@@ -1108,6 +1659,9 @@ int main(int argc, char **argv)
 	if (!gotaction)
 		help();
 
+	if (session && libxsvf_close(&h) < 0)
+		rc = 1;
+
 	if (u.retval_i) {
 		if (hex_mode) {
 			printf("0x");
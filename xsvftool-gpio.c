@@ -19,6 +19,7 @@
  */
 
 #include "libxsvf.h"
+#include "xsvftool-input.h"
 
 #include <sys/time.h>
 #include <unistd.h>
@@ -194,6 +195,7 @@ struct udata_s {
 	int bitcount_tdo;
 	int retval_i;
 	int retval[256];
+	struct xsvftool_input in;
 };
 
 static int h_setup(struct libxsvf_host *h)
@@ -253,7 +255,13 @@ static void h_udelay(struct libxsvf_host *h, long usecs, int tms, long num_tck)
 static int h_getbyte(struct libxsvf_host *h)
 {
 	struct udata_s *u = h->user_data;
-	return fgetc(u->f);
+	return xsvftool_input_getbyte(&u->in);
+}
+
+static int h_getblock(struct libxsvf_host *h, const unsigned char **block)
+{
+	struct udata_s *u = h->user_data;
+	return xsvftool_input_getblock(&u->in, block);
 }
 
 static int h_pulse_tck(struct libxsvf_host *h, int tms, int tdi, int tdo, int rmask, int sync)
@@ -312,6 +320,7 @@ static void h_set_trst(struct libxsvf_host *h, int v)
 static int h_set_frequency(struct libxsvf_host *h, int v)
 {
 	fprintf(stderr, "WARNING: Setting JTAG clock frequency to %d ignored!\n", v);
+	h->frequency = 0;
 	return 0;
 }
 
@@ -340,10 +349,18 @@ static void h_report_status(struct libxsvf_host *h, const char *message)
 
 static void h_report_error(struct libxsvf_host *h, const char *file, int line, const char *message)
 {
-	fprintf(stderr, "[%s:%d] %s\n", file, line, message);
+	const struct libxsvf_location *loc = h->error_location.command ? &h->error_location : &h->location;
+	if (loc->line > 0)
+		fprintf(stderr, "[%s:%d] %s (command %ld in line %ld)\n", file, line, message, loc->command, loc->line);
+	else if (loc->command > 0)
+		fprintf(stderr, "[%s:%d] %s (command %ld at offset %ld)\n", file, line, message, loc->command, loc->offset);
+	else
+		fprintf(stderr, "[%s:%d] %s\n", file, line, message);
 }
 
 static int realloc_maxsize[LIBXSVF_MEM_NUM];
+static void *realloc_pool[LIBXSVF_MEM_NUM];
+static int realloc_poolsize[LIBXSVF_MEM_NUM];
 
 static void *h_realloc(struct libxsvf_host *h, void *ptr, int size, enum libxsvf_mem which)
 {
@@ -353,16 +370,35 @@ static void *h_realloc(struct libxsvf_host *h, void *ptr, int size, enum libxsvf
 	if (u->verbose >= 3) {
 		fprintf(stderr, "[REALLOC:%s:%d]\n", libxsvf_mem2str(which), size);
 	}
+	// libxsvf has at most one buffer per slot, so a preallocated buffer can be handed out again and again
+	if (realloc_pool[which]) {
+		if (size <= realloc_poolsize[which])
+			return size > 0 ? realloc_pool[which] : NULL;
+		ptr = realloc_pool[which];
+		realloc_pool[which] = NULL;
+		realloc_poolsize[which] = 0;
+	}
 	return realloc(ptr, size);
 }
 
 static struct udata_s u;
 
+static struct libxsvf_checkpoint last_checkpoint;
+static int have_checkpoint;
+
+static int h_checkpoint(struct libxsvf_host *h, const struct libxsvf_checkpoint *cp)
+{
+	last_checkpoint = *cp;
+	have_checkpoint = 1;
+	return 0;
+}
+
 static struct libxsvf_host h = {
 	.udelay = h_udelay,
 	.setup = h_setup,
 	.shutdown = h_shutdown,
 	.getbyte = h_getbyte,
+	.getblock = h_getblock,
 	.pulse_tck = h_pulse_tck,
 	.pulse_sck = h_pulse_sck,
 	.set_trst = h_set_trst,
@@ -372,6 +408,7 @@ static struct libxsvf_host h = {
 	.report_status = h_report_status,
 	.report_error = h_report_error,
 	.realloc = h_realloc,
+	.checkpoint = h_checkpoint,
 	.user_data = &u
 };
 
@@ -389,11 +426,71 @@ static void copyleft()
 	already_printed = 1;
 }
 
+static int convert(const char *filename, int max_chunk)
+{
+	unsigned char *xsvf;
+	int xsvf_len, rc = 0;
+	FILE *f;
+
+	if (u.verbose)
+		fprintf(stderr, "Writing XSVF file `%s'.\n", filename);
+
+	if (libxsvf_svf2xsvf(&h, max_chunk, &xsvf, &xsvf_len) < 0)
+		return -1;
+
+	if (!strcmp(filename, "-"))
+		f = stdout;
+	else
+		f = fopen(filename, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Can't create XSVF file `%s': %s\n", filename, strerror(errno));
+		rc = -1;
+	} else {
+		if (fwrite(xsvf, xsvf_len, 1, f) != 1 || fflush(f) != 0) {
+			fprintf(stderr, "Can't write XSVF file `%s': %s\n", filename, strerror(errno));
+			rc = -1;
+		}
+		if (f != stdout)
+			fclose(f);
+	}
+
+	h.realloc(&h, xsvf, 0, LIBXSVF_MEM_SVF2XSVF_DATA);
+	return rc;
+}
+
+static int analyze(const char *filename, enum libxsvf_mode mode, long frequency)
+{
+	struct libxsvf_stats stats;
+	int i;
+
+	stats.frequency = frequency;
+	if (libxsvf_analyze(&h, &stats, mode) < 0)
+		return -1;
+
+	fprintf(stderr, "Analysis of `%s':\n", filename);
+	fprintf(stderr, "  TCK cycles: %lld\n", stats.tck);
+	if (stats.sck > 0)
+		fprintf(stderr, "  SCK cycles: %lld\n", stats.sck);
+	fprintf(stderr, "  Checked TDO bits: %lld\n", stats.tdo_bits);
+	fprintf(stderr, "  Wait time: %lld.%03lld s\n", stats.wait_usecs / 1000000, stats.wait_usecs / 1000 % 1000);
+	fprintf(stderr, "  Predicted duration at %ld Hz: %lld.%03lld s\n", frequency, stats.usecs / 1000000, stats.usecs / 1000 % 1000);
+
+	for (i = 0; i < LIBXSVF_MEM_NUM; i++) {
+		if (stats.mem_max[i] <= realloc_poolsize[i] || realloc_pool[i])
+			continue;
+		realloc_pool[i] = malloc(stats.mem_max[i]);
+		if (realloc_pool[i])
+			realloc_poolsize[i] = stats.mem_max[i];
+	}
+
+	return xsvftool_input_rewind(&u.in);
+}
+
 static void help()
 {
 	copyleft();
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Usage: %s [ -r funcname ] [ -v ... ] [ -L | -B ] { -s svf-file | -x xsvf-file | -c } ...\n", progname);
+	fprintf(stderr, "Usage: %s [ -r funcname ] [ -v ... ] [ -L | -B ] [ -k ] [ -i ] [ -R retries ] [ -m bits ] [ -z ] [ -a freq ] { [ -o xsvf-file ] -s svf-file | -x xsvf-file | -c } ...\n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -r funcname\n");
 	fprintf(stderr, "          Dump C-code for pseudo-allocator based on example files\n");
@@ -404,11 +501,39 @@ static void help()
 	fprintf(stderr, "   -L, -B\n");
 	fprintf(stderr, "          Print RMASK bits as hex value (little or big endian)\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "   -k\n");
+	fprintf(stderr, "          Keep the TAP state between files (no TAP reset after each file)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -i\n");
+	fprintf(stderr, "          Skip SIR/XSIR commands that would shift the instruction that is\n");
+	fprintf(stderr, "          already loaded (with -v the number of skipped bits is printed)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -R retries\n");
+	fprintf(stderr, "          When playing a file fails, rewind it and resume playing at the\n");
+	fprintf(stderr, "          last SIR/XSIR command before the error, up to this many times\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -m bits\n");
+	fprintf(stderr, "          Split SDR data into XSDRB/XSDRC/XSDRE commands of at most this\n");
+	fprintf(stderr, "          many bits when converting SVF to XSVF (default: no splitting)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -z\n");
+	fprintf(stderr, "          Compress register data with the libxsvf XCOMPRESSED extension\n");
+	fprintf(stderr, "          when converting SVF to XSVF (the file can only be played by libxsvf)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -a freq\n");
+	fprintf(stderr, "          Analyze each file before playing it: print the number of TCK cycles,\n");
+	fprintf(stderr, "          the wait time and the duration predicted for the given TCK frequency\n");
+	fprintf(stderr, "          in Hz, and preallocate all buffers needed to play it\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "   -o xsvf-file\n");
+	fprintf(stderr, "          Convert the SVF file of the next -s option to XSVF and write it to\n");
+	fprintf(stderr, "          the specified file instead of playing it\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "   -s svf-file\n");
-	fprintf(stderr, "          Play the specified SVF file\n");
+	fprintf(stderr, "          Play the specified SVF file (may be gzip or zlib compressed)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -x xsvf-file\n");
-	fprintf(stderr, "          Play the specified XSVF file\n");
+	fprintf(stderr, "          Play the specified XSVF file (may be gzip or zlib compressed)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -c\n");
 	fprintf(stderr, "          List devices in JTAG chain\n");
@@ -420,12 +545,17 @@ int main(int argc, char **argv)
 {
 	int rc = 0;
 	int gotaction = 0;
+	int session = 0;
 	int hex_mode = 0;
+	int max_chunk = 0;
+	int retries = 0;
+	long analyze_frequency = -1;
 	const char *realloc_name = NULL;
+	const char *xsvf_name = NULL;
 	int opt, i, j;
 
 	progname = argc >= 1 ? argv[0] : "xvsftool";
-	while ((opt = getopt(argc, argv, "r:vLBx:s:c")) != -1)
+	while ((opt = getopt(argc, argv, "r:vLBkiR:m:za:o:x:s:c")) != -1)
 	{
 		switch (opt)
 		{
@@ -436,6 +566,27 @@ int main(int argc, char **argv)
 			copyleft();
 			u.verbose++;
 			break;
+		case 'k':
+			h.flags |= LIBXSVF_FLAG_KEEP_TAPSTATE;
+			break;
+		case 'i':
+			h.flags |= LIBXSVF_FLAG_SKIP_SAME_IR;
+			break;
+		case 'R':
+			retries = atoi(optarg);
+			break;
+		case 'm':
+			max_chunk = atoi(optarg);
+			break;
+		case 'z':
+			h.flags |= LIBXSVF_FLAG_COMPRESS_XSVF;
+			break;
+		case 'a':
+			analyze_frequency = atol(optarg);
+			break;
+		case 'o':
+			xsvf_name = optarg;
+			break;
 		case 'x':
 		case 's':
 			gotaction = 1;
@@ -450,16 +601,56 @@ int main(int argc, char **argv)
 				rc = 1;
 				break;
 			}
-			if (libxsvf_play(&h, opt == 's' ? LIBXSVF_MODE_SVF : LIBXSVF_MODE_XSVF) < 0) {
-				fprintf(stderr, "Error while playing %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
+			if (xsvftool_input_start(&u.in, u.f) < 0) {
+				rc = 1;
+			} else if (opt == 's' && xsvf_name) {
+				if (convert(xsvf_name, max_chunk) < 0) {
+					fprintf(stderr, "Error while converting SVF file `%s'.\n", optarg);
+					rc = 1;
+				}
+				xsvf_name = NULL;
+			} else if (analyze_frequency >= 0 && u.f != stdin &&
+					analyze(optarg, opt == 's' ? LIBXSVF_MODE_SVF : LIBXSVF_MODE_XSVF, analyze_frequency) < 0) {
+				fprintf(stderr, "Error while analyzing %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
+				rc = 1;
+			} else if (!session && libxsvf_open(&h) < 0) {
+				rc = 1;
+			} else {
+				enum libxsvf_mode mode = opt == 's' ? LIBXSVF_MODE_SVF : LIBXSVF_MODE_XSVF;
+				int play_rc, tries = retries;
+				session = 1;
+				have_checkpoint = 0;
+				play_rc = libxsvf_run(&h, mode);
+				while (play_rc < 0 && tries-- > 0 && have_checkpoint && u.f != stdin) {
+					struct libxsvf_checkpoint cp = last_checkpoint;
+					fprintf(stderr, "Resuming %s file `%s' at command %ld.\n", opt == 's' ? "SVF" : "XSVF", optarg, cp.location.command);
+					if (xsvftool_input_rewind(&u.in) < 0)
+						break;
+					play_rc = libxsvf_resume(&h, mode, &cp);
+				}
+				if (play_rc < 0) {
+					fprintf(stderr, "Error while playing %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
+					rc = 1;
+				}
+				if (u.verbose && (h.flags & LIBXSVF_FLAG_SKIP_SAME_IR))
+					fprintf(stderr, "Skipped %ld bits of repeated IR shifts.\n", h.skipped_ir_bits);
+			}
+			if (u.in.error) {
+				fprintf(stderr, "Error while reading %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
 				rc = 1;
 			}
+			xsvftool_input_end(&u.in);
 			if (strcmp(optarg, "-"))
 				fclose(u.f);
 			break;
 		case 'c':
 			gotaction = 1;
-			if (libxsvf_play(&h, LIBXSVF_MODE_SCAN) < 0) {
+			if (!session && libxsvf_open(&h) < 0) {
+				rc = 1;
+				break;
+			}
+			session = 1;
+			if (libxsvf_run(&h, LIBXSVF_MODE_SCAN) < 0) {
 				fprintf(stderr, "Error while scanning JTAG chain.\n");
 				rc = 1;
 			}
@@ -479,6 +670,9 @@ int main(int argc, char **argv)
 	if (!gotaction)
 		help();
 
+	if (session && libxsvf_close(&h) < 0)
+		rc = 1;
+
 	if (u.verbose) {
 		fprintf(stderr, "Total number of clock cycles: %d\n", u.clockcount);
 		fprintf(stderr, "Number of significant TDI bits: %d\n", u.bitcount_tdi);
@@ -0,0 +1,149 @@
+/*
+ *  Lib(X)SVF  -  A library for implementing SVF and XSVF JTAG players
+ *
+ *  Copyright (C) 2009  RIEGL Research ForschungsGmbH
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "xsvftool-input.h"
+
+#include <string.h>
+
+int xsvftool_input_start(struct xsvftool_input *in, FILE *f)
+{
+	in->f = f;
+	in->error = 0;
+	in->buf_pos = 0;
+	in->buf_len = fread(in->buf, 1, 2, f);
+
+#ifndef XSVFTOOL_NO_ZLIB
+	in->inflate = in->buf_len == 2 && ((in->buf[0] == 0x1f && in->buf[1] == 0x8b) ||
+			(in->buf[0] == 0x78 && (in->buf[0] << 8 | in->buf[1]) % 31 == 0));
+	in->inflate_done = 0;
+	if (!in->inflate)
+		return 0;
+
+	memset(&in->zs, 0, sizeof(in->zs));
+	if (inflateInit2(&in->zs, 15 + 32) != Z_OK) {
+		fprintf(stderr, "Can't initialize zlib.\n");
+		in->inflate = 0;
+		return -1;
+	}
+	memcpy(in->zbuf, in->buf, 2);
+	in->zs.next_in = in->zbuf;
+	in->zs.avail_in = 2;
+	in->buf_len = 0;
+#endif
+
+	return 0;
+}
+
+void xsvftool_input_end(struct xsvftool_input *in)
+{
+#ifndef XSVFTOOL_NO_ZLIB
+	if (in->inflate)
+		inflateEnd(&in->zs);
+	in->inflate = 0;
+#endif
+	in->buf_pos = in->buf_len = 0;
+}
+
+int xsvftool_input_rewind(struct xsvftool_input *in)
+{
+	xsvftool_input_end(in);
+	rewind(in->f);
+	return xsvftool_input_start(in, in->f);
+}
+
+#ifndef XSVFTOOL_NO_ZLIB
+static int fill_inflate(struct xsvftool_input *in)
+{
+	in->zs.next_out = in->buf;
+	in->zs.avail_out = sizeof(in->buf);
+	while (in->zs.avail_out > 0) {
+		if (in->zs.avail_in == 0) {
+			in->zs.next_in = in->zbuf;
+			in->zs.avail_in = fread(in->zbuf, 1, sizeof(in->zbuf), in->f);
+			if (in->zs.avail_in == 0) {
+				if (ferror(in->f))
+					return -1;
+				if (!in->inflate_done) {
+					fprintf(stderr, "Compressed input file is truncated.\n");
+					return -1;
+				}
+				break;
+			}
+		}
+		// concatenated gzip files are played one after the other, like gzip -d does
+		if (in->inflate_done) {
+			inflateReset(&in->zs);
+			in->inflate_done = 0;
+		}
+		int rc = inflate(&in->zs, Z_NO_FLUSH);
+		if (rc == Z_STREAM_END)
+			in->inflate_done = 1;
+		else if (rc != Z_OK) {
+			fprintf(stderr, "Error in compressed input file: %s\n", in->zs.msg ? in->zs.msg : "unknown error");
+			return -1;
+		}
+	}
+	return sizeof(in->buf) - in->zs.avail_out;
+}
+#endif
+
+// read the next block of the file into in->buf, returns 0 at the end of the file and -1 on errors
+static int fill(struct xsvftool_input *in)
+{
+	int len;
+
+#ifndef XSVFTOOL_NO_ZLIB
+	if (in->inflate)
+		len = fill_inflate(in);
+	else
+#endif
+	{
+		len = fread(in->buf, 1, sizeof(in->buf), in->f);
+		if (len == 0 && ferror(in->f))
+			len = -1;
+	}
+
+	if (len < 0)
+		in->error = 1;
+	in->buf_pos = 0;
+	in->buf_len = len < 0 ? 0 : len;
+	return len;
+}
+
+int xsvftool_input_getbyte(struct xsvftool_input *in)
+{
+	if (in->buf_pos == in->buf_len && fill(in) <= 0)
+		return -1;
+	return in->buf[in->buf_pos++];
+}
+
+int xsvftool_input_getblock(struct xsvftool_input *in, const unsigned char **block)
+{
+	int len;
+
+	if (in->buf_pos == in->buf_len && fill(in) < 0)
+		return -1;
+
+	*block = in->buf + in->buf_pos;
+	len = in->buf_len - in->buf_pos;
+	in->buf_pos = in->buf_len;
+	return len;
+}
+
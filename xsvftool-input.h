@@ -0,0 +1,56 @@
+/*
+ *  Lib(X)SVF  -  A library for implementing SVF and XSVF JTAG players
+ *
+ *  Copyright (C) 2009  RIEGL Research ForschungsGmbH
+ *  Copyright (C) 2009  Clifford Wolf <clifford@clifford.at>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef XSVFTOOL_INPUT_H
+#define XSVFTOOL_INPUT_H
+
+/*
+ * The input files of the xsvftool programs. Files that start with a gzip
+ * or zlib header are inflated while they are read, unless the programs are
+ * built with XSVFTOOL_NO_ZLIB.
+ */
+
+#include <stdio.h>
+#ifndef XSVFTOOL_NO_ZLIB
+#  include <zlib.h>
+#endif
+
+struct xsvftool_input {
+	FILE *f;
+	unsigned char buf[64*1024];
+	int buf_pos, buf_len;
+	// set when reading failed: libxsvf takes it for the end of the file
+	int error;
+#ifndef XSVFTOOL_NO_ZLIB
+	unsigned char zbuf[64*1024];
+	int inflate, inflate_done;
+	z_stream zs;
+#endif
+};
+
+int xsvftool_input_start(struct xsvftool_input *in, FILE *f);
+void xsvftool_input_end(struct xsvftool_input *in);
+int xsvftool_input_rewind(struct xsvftool_input *in);
+
+int xsvftool_input_getbyte(struct xsvftool_input *in);
+int xsvftool_input_getblock(struct xsvftool_input *in, const unsigned char **block);
+
+#endif
+
@@ -26,6 +26,7 @@
 #include <sys/time.h>
 
 #include "libxsvf.h"
+#include "xsvftool-input.h"
 #include "fx2usb-interface.h"
 
 #include "filedata.h"
@@ -69,6 +70,7 @@ char *correct_cksum =
 /**** END: http://svn.clifford.at/tools/trunk/examples/check.h ****/
 
 FILE *file_fp = NULL;
+struct xsvftool_input file_in;
 
 int usb_vendor_id = 0;
 int usb_device_id = 0;
@@ -256,7 +258,7 @@ static void xpcu_udelay(struct libxsvf_host *h UNUSED, long usecs, int tms, long
 
 static int xpcu_getbyte(struct libxsvf_host *h UNUSED)
 {
-	return fgetc(file_fp);
+	return xsvftool_input_getbyte(&file_in);
 }
 
 static int xpcu_pulse_tck(struct libxsvf_host *h UNUSED, int tms, int tdi, int tdo, int rmask, int sync)
@@ -531,10 +533,10 @@ static void help()
 	fprintf(stderr, "          Erase the CPLD on the probe\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -s svf-file\n");
-	fprintf(stderr, "          Play the specified SVF file\n");
+	fprintf(stderr, "          Play the specified SVF file (may be gzip or zlib compressed)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -x xsvf-file\n");
-	fprintf(stderr, "          Play the specified XSVF file\n");
+	fprintf(stderr, "          Play the specified XSVF file (may be gzip or zlib compressed)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "   -c\n");
 	fprintf(stderr, "          List devices in JTAG chain\n");
@@ -594,7 +596,9 @@ int main(int argc, char **argv)
 					i = mode_internal_cpld;
 					mode_internal_cpld = 1;
 					file_fp = CHECK_PTR(fmemopen(hardware_svf, sizeof(hardware_svf), "r"), != NULL);
+					xsvftool_input_start(&file_in, file_fp);
 					libxsvf_play(&h, LIBXSVF_MODE_SVF);
+					xsvftool_input_end(&file_in);
 					mode_internal_cpld = i;
 					fclose(file_fp);
 				}
@@ -643,7 +647,9 @@ int main(int argc, char **argv)
 				file_fp = CHECK_PTR(fmemopen(erasecpld_svf, sizeof(erasecpld_svf), "r"), != NULL);
 				fprintf(stderr, "Erasing CPLD on the probe..\n");
 			}
+			xsvftool_input_start(&file_in, file_fp);
 			libxsvf_play(&h, LIBXSVF_MODE_SVF);
+			xsvftool_input_end(&file_in);
 			mode_internal_cpld = i;
 			fclose(file_fp);
 			break;
@@ -660,10 +666,14 @@ int main(int argc, char **argv)
 				break;
 			}
 			fprintf(stderr, "Playing %s file `%s'..\n", opt == 's' ? "SVF" : "XSVF", optarg);
-			if (libxsvf_play(&h, opt == 's' ? LIBXSVF_MODE_SVF : LIBXSVF_MODE_XSVF) < 0) {
+			if (xsvftool_input_start(&file_in, file_fp) < 0 || libxsvf_play(&h, opt == 's' ? LIBXSVF_MODE_SVF : LIBXSVF_MODE_XSVF) < 0) {
 				fprintf(stderr, "Error while playing %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
 				rc = 1;
+			} else if (file_in.error) {
+				fprintf(stderr, "Error while reading %s file `%s'.\n", opt == 's' ? "SVF" : "XSVF", optarg);
+				rc = 1;
 			}
+			xsvftool_input_end(&file_in);
 			if (strcmp(optarg, "-"))
 				fclose(file_fp);
 			break;